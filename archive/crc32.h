@@ -0,0 +1,31 @@
+/**
+ * CRC-32 (the zlib / PNG one)
+ *
+ * Byte at a time with a 256 entry table built by the compiler, like the
+ * bitscale tables. Start with crc32_update(0, ...), and keep passing the
+ * result to add more data.
+ */
+
+#include <stdint.h>
+
+// Reference remainder of one byte, only evaluated at compile time to fill the table
+constexpr uint32_t crc32_remainder(uint32_t c, int8_t bits)
+{
+    return (bits == 0) ? c : crc32_remainder((c & 1) ? (0xEDB88320UL ^ (c >> 1)) : (c >> 1), bits - 1);
+}
+
+#define CRC32_4(n) crc32_remainder(n, 8), crc32_remainder(n + 1, 8), crc32_remainder(n + 2, 8), crc32_remainder(n + 3, 8)
+#define CRC32_16(n) CRC32_4(n), CRC32_4(n + 4), CRC32_4(n + 8), CRC32_4(n + 12)
+#define CRC32_64(n) CRC32_16(n), CRC32_16(n + 16), CRC32_16(n + 32), CRC32_16(n + 48)
+
+static const uint32_t crc32_table[256] = {CRC32_64(0), CRC32_64(64), CRC32_64(128), CRC32_64(192)};
+
+inline uint32_t crc32_update(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    crc = ~crc;
+    for (unsigned int i = 0; i < length; i++)
+    {
+        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
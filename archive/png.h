@@ -0,0 +1,159 @@
+/**
+ * Streaming PNG writer
+ *
+ * Rows go out a strip at a time, each strip as one IDAT chunk holding a
+ * stored (uncompressed) deflate block. No zlib and no image buffer are
+ * needed, and a 2 bit image is still only a quarter of a 8 bit one.
+ * Game Boy images end when the PRINT packet comes, so the height is not
+ * known up front: the IHDR chunk is written with height 0, and rewritten
+ * from pngHeader() at PNG_HEADER_OFFSET once the image is finished.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "crc32.h"
+
+#define PNG_HEADER_OFFSET 8  // IHDR chunk, after the signature
+#define PNG_HEADER_LENGTH 25 // whole IHDR chunk
+#define PNG_GRAY 0           // color type
+
+typedef void (*png_write_t)(void *context, const uint8_t *data, unsigned int length);
+
+typedef struct png_t
+{
+    png_write_t write;
+    void *context;
+    uint16_t width;    // pixels
+    uint8_t depth;     // bits per pixel
+    uint32_t height;   // rows written so far
+    uint32_t crc;      // of the chunk being written
+    uint32_t adler_a;  // Adler-32 of the zlib stream
+    uint32_t adler_b;
+} png_t;
+
+inline void pngPut32(uint8_t *dst, uint32_t value)
+{
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
+}
+
+/**
+ * Writes part of a chunk, adding it to the chunk's CRC
+ */
+inline void pngChunkData(png_t *png, const uint8_t *data, unsigned int length)
+{
+    png->crc = crc32_update(png->crc, data, length);
+    png->write(png->context, data, length);
+}
+
+/**
+ * Starts a chunk of "length" bytes (not counting the type)
+ */
+inline void pngChunkBegin(png_t *png, const char *type, uint32_t length)
+{
+    uint8_t header[4];
+    pngPut32(header, length);
+    png->write(png->context, header, 4);
+    png->crc = 0;
+    pngChunkData(png, (const uint8_t *)type, 4);
+}
+
+inline void pngChunkEnd(png_t *png)
+{
+    uint8_t crc[4];
+    pngPut32(crc, png->crc);
+    png->write(png->context, crc, 4);
+}
+
+/**
+ * Fills the 25 byte IHDR chunk
+ */
+inline void pngHeader(const png_t *png, uint8_t *chunk)
+{
+    pngPut32(chunk, 13);
+    memcpy(chunk + 4, "IHDR", 4);
+    pngPut32(chunk + 8, png->width);
+    pngPut32(chunk + 12, png->height);
+    chunk[16] = png->depth;
+    chunk[17] = PNG_GRAY;
+    chunk[18] = 0; // deflate
+    chunk[19] = 0; // adaptive filtering, only "none" is used
+    chunk[20] = 0; // not interlaced
+    pngPut32(chunk + 21, crc32_update(0, chunk + 4, 17));
+}
+
+/**
+ * Writes the signature, the IHDR chunk with height 0 and the zlib header
+ */
+inline void pngBegin(png_t *png, uint16_t width, uint8_t depth, png_write_t write, void *context)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    static const uint8_t zlib[2] = {0x78, 0x01};
+    uint8_t header[PNG_HEADER_LENGTH];
+
+    png->write = write;
+    png->context = context;
+    png->width = width;
+    png->depth = depth;
+    png->height = 0;
+    png->adler_a = 1;
+    png->adler_b = 0;
+
+    write(context, signature, sizeof(signature));
+    pngHeader(png, header);
+    write(context, header, sizeof(header));
+    pngChunkBegin(png, "IDAT", sizeof(zlib));
+    pngChunkData(png, zlib, sizeof(zlib));
+    pngChunkEnd(png);
+}
+
+/**
+ * Adds "count" rows of packed pixels, "stride" bytes apart, as one IDAT chunk
+ */
+inline void pngRows(png_t *png, const uint8_t *rows, unsigned int count, unsigned int stride)
+{
+    unsigned int rowBytes = (png->width * png->depth + 7) / 8;
+    uint16_t length = count * (rowBytes + 1); // one stored block, up to 65535 bytes
+    uint8_t block[5] = {0, (uint8_t)length, (uint8_t)(length >> 8), (uint8_t)~length, (uint8_t)(~length >> 8)};
+    static const uint8_t filter = 0;
+
+    pngChunkBegin(png, "IDAT", sizeof(block) + length);
+    pngChunkData(png, block, sizeof(block));
+    for (unsigned int r = 0; r < count; r++)
+    {
+        const uint8_t *row = rows + r * stride;
+        pngChunkData(png, &filter, 1);
+        pngChunkData(png, row, rowBytes);
+
+        // Adler-32, a row is far too short for the sums to overflow
+        png->adler_b = (png->adler_b + png->adler_a) % 65521;
+        for (unsigned int i = 0; i < rowBytes; i++)
+        {
+            png->adler_a += row[i];
+            png->adler_b += png->adler_a;
+        }
+        png->adler_a %= 65521;
+        png->adler_b %= 65521;
+    }
+    pngChunkEnd(png);
+    png->height += count;
+}
+
+/**
+ * Closes the zlib stream and writes IEND, the caller then rewrites the header
+ */
+inline void pngEnd(png_t *png)
+{
+    static const uint8_t last[5] = {1, 0, 0, 0xFF, 0xFF}; // empty final stored block
+    uint8_t adler[4];
+    pngPut32(adler, (png->adler_b << 16) | png->adler_a);
+
+    pngChunkBegin(png, "IDAT", sizeof(last) + sizeof(adler));
+    pngChunkData(png, last, sizeof(last));
+    pngChunkData(png, adler, sizeof(adler));
+    pngChunkEnd(png);
+    pngChunkBegin(png, "IEND", 0);
+    pngChunkEnd(png);
+}
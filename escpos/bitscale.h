@@ -0,0 +1,61 @@
+/**
+ * Bit scaling lookup tables
+ *
+ * bitscale<BY>(src) copies each bit in the source byte BY times, using
+ * a 256 entry table built by the compiler (1x - 4x, 4x fills all 32 bits)
+ * example for BY = 3:
+ * src: 000000000000000010010011
+ * dst: 111000000111000000111111
+ */
+
+#include <stdint.h>
+
+// Reference expansion, only evaluated at compile time to fill the tables
+constexpr uint32_t bitscale_expand(uint8_t src, uint8_t by, int8_t i)
+{
+    return (i < 0) ? 0 : ((((src >> i) & 1) ? (((uint32_t)1 << by) - 1) : 0) << (i * by)) | bitscale_expand(src, by, i - 1);
+}
+
+#define BITSCALE_4(by, n) bitscale_expand(n, by, 7), bitscale_expand(n + 1, by, 7), bitscale_expand(n + 2, by, 7), bitscale_expand(n + 3, by, 7)
+#define BITSCALE_16(by, n) BITSCALE_4(by, n), BITSCALE_4(by, n + 4), BITSCALE_4(by, n + 8), BITSCALE_4(by, n + 12)
+#define BITSCALE_64(by, n) BITSCALE_16(by, n), BITSCALE_16(by, n + 16), BITSCALE_16(by, n + 32), BITSCALE_16(by, n + 48)
+#define BITSCALE_256(by) BITSCALE_64(by, 0), BITSCALE_64(by, 64), BITSCALE_64(by, 128), BITSCALE_64(by, 192)
+
+template <uint8_t BY>
+struct bitscale_table
+{
+    static_assert(BY >= 1 && BY <= 4, "scaled byte must fit in 32 bits");
+    static const uint32_t table[256];
+};
+
+template <uint8_t BY>
+const uint32_t bitscale_table<BY>::table[256] = {BITSCALE_256(BY)};
+
+template <uint8_t BY>
+inline uint32_t bitscale(uint8_t src)
+{
+    return bitscale_table<BY>::table[src];
+}
+
+template <>
+inline uint32_t bitscale<1>(uint8_t src)
+{
+    return src;
+}
+
+/**
+ * Scales a raster line horizontally, returns the number of bytes written to dst
+ */
+template <uint8_t BY>
+inline unsigned int bitscale_line(const uint8_t *src, unsigned int length, uint8_t *dst)
+{
+    for (unsigned int i = 0; i < length; i++)
+    {
+        uint32_t out = bitscale<BY>(src[i]);
+        for (int8_t b = BY - 1; b >= 0; b--)
+        {
+            *dst++ = out >> (8 * b) & 0xFF;
+        }
+    }
+    return length * BY;
+}
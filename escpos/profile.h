@@ -0,0 +1,44 @@
+/**
+ * Printer profiles
+ *
+ * What a printer takes and how fast, saved in NVS for every printer address,
+ * so one firmware can print at full speed on 58 mm and 80 mm printers.
+ * The encoder is picked at print time from the commands the profile lists.
+ */
+
+#include <stdint.h>
+
+#define PROFILE_VERSION 1 // change when printer_profile_t changes, older saved profiles are ignored
+
+#define PROFILE_ESC_ASTERISK 0x01 // ESC * bit image
+#define PROFILE_GS_V0 0x02        // GS v 0 raster bit image
+#define PROFILE_GS_L 0x04         // GS ( L graphics
+
+#define PROFILE_NO_SKIP 0x01    // flag, blank rows and columns are sent instead of fed or cut
+#define PROFILE_MULTI_TONE 0x02 // flag, GS ( L takes multiple tone data, grays are printed natively at 1x and 2x
+
+typedef struct printer_profile_t
+{
+    uint8_t version;      // PROFILE_VERSION
+    uint8_t commands;     // PROFILE_* the printer supports
+    uint8_t command;      // PROFILE_* always used when it fits, 0 picks the fastest supported one
+    uint8_t lineSpacing;  // ESC 3 spacing for ESC * bands, in dots
+    uint16_t headDots;    // printable dots per line, 384 for 58 mm, 576 for 80 mm
+    uint16_t maxPayload;  // most image bytes the printer takes in one command
+    uint8_t bandFeed;     // lines fed after each ESC * band
+    uint8_t flags;        // PROFILE_NO_SKIP, PROFILE_MULTI_TONE
+    uint16_t bandDelayMs; // pause after each band, for printers that lose data when rushed
+} printer_profile_t;
+
+/**
+ * Rows of "rowBytes" that fit in one command, at least 1 and at most "limit"
+ */
+inline unsigned int profileBandRows(const printer_profile_t *profile, unsigned int rowBytes, unsigned int limit)
+{
+    unsigned int rows = profile->maxPayload / rowBytes;
+    if (rows < 1)
+    {
+        rows = 1;
+    }
+    return (rows < limit) ? rows : limit;
+}
@@ -0,0 +1,223 @@
+/**
+ * Game Boy pixels to printer dots
+ *
+ * Images are kept as 2bpp color rows (4 pixels per byte, leftmost pixel in
+ * the high bits). rasterRow() turns one of them into a 1bpp row at the output
+ * scale, mapping the colors through the print palette and then either a
+ * threshold, a 4x4 Bayer matrix or Floyd-Steinberg error diffusion.
+ * Dithering works on dots, not pixels, so scaled prints get more gray levels.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define RASTER_PIXELS 160 // pixels in a Game Boy row
+#define RASTER_MAX_SCALE 4 // rasterRow() has a case for every scale up to this one
+#define RASTER_MAX_DOTS (RASTER_PIXELS * RASTER_MAX_SCALE)
+
+#define DITHER_NONE 0      // colors from the threshold up are black
+#define DITHER_BAYER 1     // ordered dithering
+#define DITHER_DIFFUSION 2 // error diffusion
+
+#define RASTER_MONO 0xFF // plane value for 1 bit output
+#define RASTER_DEFAULT_PALETTE 0xE4 // used for palette 0
+
+typedef struct raster_t
+{
+    uint8_t xScale;     // dots per pixel horizontally
+    uint8_t dither;     // DITHER_*
+    uint8_t level[4];   // darkness (0-255) of each color after the palette
+    uint8_t white;      // bit c is set if color c prints no dots
+    uint16_t dots[4][256]; // 2bpp byte -> 4 * xScale dots, for each Bayer row
+    int16_t error[2][RASTER_MAX_DOTS + 2]; // diffusion error of this and the next row
+    unsigned int row;   // output rows produced so far
+} raster_t;
+
+static const uint8_t raster_bayer[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5}};
+
+/**
+ * Prepares the tables for a print
+ * palette: Game Boy print palette, 2 bits per color starting with color 0 in the low bits (0 is the default, 0xE4)
+ * threshold: darkest shades (0-3) from this one up are black when not dithering
+ * plane: RASTER_MONO, or the bit (0-3) of the 4 bit gray wanted for multiple tone data
+ */
+inline void rasterBegin(raster_t *r, uint8_t xScale, uint8_t palette, uint8_t dither, uint8_t threshold, uint8_t plane)
+{
+    if (palette == 0)
+    {
+        palette = RASTER_DEFAULT_PALETTE;
+    }
+    r->xScale = xScale;
+    r->dither = (plane == RASTER_MONO) ? dither : DITHER_NONE;
+    r->row = 0;
+    memset(r->error, 0, sizeof(r->error));
+
+    uint8_t shade[4];
+    r->white = 0;
+    for (uint8_t c = 0; c < 4; c++)
+    {
+        shade[c] = (palette >> (2 * c)) & 3;
+        r->level[c] = shade[c] * 85;
+        // every plane of a multiple tone image must agree, so only white stays white there
+        bool white = (plane != RASTER_MONO || r->dither != DITHER_NONE) ? (shade[c] == 0) : (shade[c] < threshold);
+        r->white |= white << c;
+    }
+
+    for (uint8_t y = 0; y < 4; y++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint16_t dots = 0;
+            for (int8_t p = 3; p >= 0; p--)
+            {
+                uint8_t c = (b >> (2 * p)) & 3;
+                for (uint8_t k = 0; k < xScale; k++)
+                {
+                    // every byte starts at a multiple of 4 dots, so x & 3 is the Bayer column
+                    uint8_t x = ((3 - p) * xScale + k) & 3;
+                    bool dot;
+                    if (plane != RASTER_MONO)
+                    {
+                        dot = ((shade[c] * 5) >> plane) & 1; // 0, 5, 10, 15 out of 15
+                    }
+                    else if (r->dither == DITHER_BAYER)
+                    {
+                        dot = r->level[c] > raster_bayer[y][x] * 16 + 8;
+                    }
+                    else
+                    {
+                        dot = shade[c] >= threshold;
+                    }
+                    dots = (dots << 1) | dot;
+                }
+            }
+            r->dots[y][b] = dots;
+        }
+    }
+}
+
+/**
+ * Error diffusion of one output row, with XSCALE dots per pixel
+ */
+template <uint8_t XSCALE>
+inline unsigned int rasterDiffuse(raster_t *r, const uint8_t *src, uint8_t *dst)
+{
+    int16_t *error = r->error[r->row & 1];
+    int16_t *next = r->error[(r->row + 1) & 1];
+    memset(next, 0, sizeof(r->error[0]));
+
+    uint8_t out = 0;
+    unsigned int x = 0;
+    for (unsigned int p = 0; p < RASTER_PIXELS; p++)
+    {
+        uint8_t level = r->level[(src[p / 4] >> (6 - 2 * (p & 3))) & 3];
+        for (uint8_t k = 0; k < XSCALE; k++, x++)
+        {
+            int16_t v = level + error[x + 1];
+            uint8_t dot = v >= 128;
+            int16_t e = v - (dot ? 255 : 0);
+            error[x + 2] += e * 7 / 16;
+            next[x] += e * 3 / 16;
+            next[x + 1] += e * 5 / 16;
+            next[x + 2] += e / 16;
+
+            out = (out << 1) | dot;
+            if ((x & 7) == 7)
+            {
+                *dst++ = out;
+            }
+        }
+    }
+    r->row++;
+    return RASTER_PIXELS * XSCALE / 8;
+}
+
+/**
+ * Counts the pixels of a 2bpp row that print no dots, from the left and from the right
+ * Both are RASTER_PIXELS for a blank row
+ * With error diffusion white pixels next to darker ones may still get a dot, it is left out
+ */
+inline void rasterMargins(const raster_t *r, const uint8_t *src, unsigned int *left, unsigned int *right)
+{
+    *left = RASTER_PIXELS;
+    *right = RASTER_PIXELS;
+    for (unsigned int x = 0; x < RASTER_PIXELS; x++)
+    {
+        uint8_t c = (src[x / 4] >> (6 - 2 * (x & 3))) & 3;
+        if (!((r->white >> c) & 1))
+        {
+            if (*left == RASTER_PIXELS)
+            {
+                *left = x;
+            }
+            *right = RASTER_PIXELS - 1 - x;
+        }
+    }
+}
+
+/**
+ * Skips output rows that are not sent, keeping the Bayer matrix in phase
+ */
+inline void rasterSkip(raster_t *r, unsigned int rows)
+{
+    if (rows == 0)
+    {
+        return;
+    }
+    r->row += rows;
+    memset(r->error, 0, sizeof(r->error));
+}
+
+/**
+ * rasterRow() for an xScale known at compile time, so the dots of a source
+ * byte are a constant 4 * XSCALE bits and the packing loop unrolls
+ */
+template <uint8_t XSCALE>
+inline unsigned int rasterRowScaled(raster_t *r, const uint8_t *src, uint8_t *dst)
+{
+    if (r->dither == DITHER_DIFFUSION)
+    {
+        return rasterDiffuse<XSCALE>(r, src, dst);
+    }
+
+    const uint16_t *dots = r->dots[r->row & 3];
+    const uint8_t bits = 4 * XSCALE;
+    uint32_t acc = 0;
+    uint8_t pending = 0;
+    uint8_t *out = dst;
+    for (unsigned int i = 0; i < RASTER_PIXELS / 4; i++)
+    {
+        acc = (acc << bits) | dots[src[i]];
+        pending += bits;
+        while (pending >= 8)
+        {
+            pending -= 8;
+            *out++ = acc >> pending;
+        }
+    }
+    r->row++;
+    return out - dst;
+}
+
+/**
+ * Produces the next output row from a 2bpp row, call it once for every dot row
+ * (yScale times per pixel row). Returns the number of bytes written to dst
+ */
+inline unsigned int rasterRow(raster_t *r, const uint8_t *src, uint8_t *dst)
+{
+    switch (r->xScale)
+    {
+    case 1:
+        return rasterRowScaled<1>(r, src, dst);
+    case 2:
+        return rasterRowScaled<2>(r, src, dst);
+    case 3:
+        return rasterRowScaled<3>(r, src, dst);
+    default:
+        return rasterRowScaled<4>(r, src, dst);
+    }
+}
@@ -24,8 +24,31 @@
 #define GBP_SD_PIN   // Pin 5            : Serial Data  (Unused)
 #define GBP_GND_PIN  // Pin 6            : GND (Attach to GND Pin)
 
-
-#define GBP_PACKET_PRETEND_PRINT_TIME_MS 2000 // ms to pretend to print for
+/* More Game Boys, each one on its own link port */
+#define GBP_PORTS 1     // Link ports in use, the second one is on these pins
+#define GBP_SO_PIN_2 25 // Pin 2            : Serial OUTPUT
+#define GBP_SI_PIN_2 26 // Pin 3            : Serial INPUT
+#define GBP_SC_PIN_2 27 // Pin 4            : Serial Clock (Interrupt)
+
+
+/* Link Backend */
+// 0: bit-banged rising clock ISR
+// 1: VSPI peripheral in slave mode shifts the bits (SC = CLK, SO = MOSI, SI = MISO), one interrupt per byte
+#define GBP_LINK_SPI_SLAVE 0
+
+/* Link pins are read and written through the GPIO registers inside the ISR */
+#if (GBP_SO_PIN > 31) || (GBP_SI_PIN > 31) || (GBP_SC_PIN > 31)
+#error "Link cable pins must be GPIO0-31 (GPIO.in / GPIO.out_w1ts registers)"
+#endif
+#if (GBP_PORTS > 1) && ((GBP_SO_PIN_2 > 31) || (GBP_SI_PIN_2 > 31) || (GBP_SC_PIN_2 > 31))
+#error "Link cable pins must be GPIO0-31 (GPIO.in / GPIO.out_w1ts registers)"
+#endif
+#if (GBP_PORTS > 2) || (GBP_LINK_SPI_SLAVE && (GBP_PORTS > 1))
+#error "Up to 2 link ports, and only one with the SPI backend (there is one free SPI peripheral)"
+#endif
+#define GBP_PIN_READ(pin) ((GPIO.in >> (pin)) & 0x1)
+#define GBP_PIN_HIGH(pin) (GPIO.out_w1ts = (1UL << (pin)))
+#define GBP_PIN_LOW(pin) (GPIO.out_w1tc = (1UL << (pin)))
 
 #define PRINT_LENGTH_AND_CRC 0
 
@@ -33,10 +56,21 @@
 *******************************************************************************/
 
 #include "gameboy_printer_protocol.h"
+#include "esp_timer.h"
+
+#if GBP_LINK_SPI_SLAVE
+#include "driver/pcnt.h"
+#include "driver/periph_ctrl.h"
+#include "soc/spi_struct.h"
+#include "soc/gpio_sig_map.h"
+#endif
 
 #define NO_NEW_BIT -1
 #define NO_NEW_BYTE -1
 #define GBP_PACKET_TIMEOUT_MS 100 // ms timeout period to wait for next byte in a packet
+#define GBP_PACKET_RING_SIZE 4    // received packets waiting for loop(), must be a power of two
+#define GBP_PACKET_BUFFER_SIZE 650 // payload bytes a packet may expand to (640 bytes usually)
+#define GBP_STATS_BINS 16          // ISR time histogram, bin n counts calls under 2^n cycles (the last one the rest)
 
 /************************************************************************/
 
@@ -80,6 +114,22 @@ typedef struct gbp_packet_t
     uint8_t printer_status;
 } gbp_packet_t;
 
+// One received packet, header and payload
+typedef struct gbp_packet_slot_t
+{
+    gbp_packet_t packet;
+    uint8_t data[GBP_PACKET_BUFFER_SIZE];
+} gbp_packet_slot_t;
+
+// Single producer (ISR), single consumer (loop) queue of received packets
+typedef struct gbp_packet_ring_t
+{
+    gbp_packet_slot_t slots[GBP_PACKET_RING_SIZE];
+    volatile uint8_t head;     // Next slot to fill, only written by the ISR
+    volatile uint8_t tail;     // Next slot to process, only written by the consumer
+    volatile uint32_t dropped; // Packets NAKed because the consumer did not keep up
+} gbp_packet_ring_t;
+
 /******************************************************************************/
 //  GAMEBOY PRINTER FUNCTIONS (Stream Byte Version)
 /******************************************************************************/
@@ -93,9 +143,6 @@ typedef struct gbp_rx_tx_byte_buffer_t
 {
     bool initialized;
 
-    // Bit State
-    int serial_clock_state_prev; // Previous Serial Clock State
-
     // Sync word
     bool syncronised;     // Is true when byte is aligned
     uint16_t sync_word;   // Sync word to match against
@@ -118,38 +165,71 @@ typedef struct gbp_packet_parser_t
     gbp_parse_state_t parse_state;
     uint16_t data_index;
     uint16_t calculated_checksum;
+    gbp_packet_slot_t *slot; // Ring slot reserved for this packet, NULL if the ring was full
+
+    // Decompression
+    uint16_t decoded_length; // Payload bytes written to data_ptr so far
+    uint8_t rle_remaining;   // Literal bytes left in the current block, 0 when a control byte is next
+    bool rle_run;            // Current block repeats the next byte
 
     // Debug Record
     uint8_t crc_high;
     uint8_t crc_low;
 } gbp_packet_parser_t;
 
+// Link statistics, counted by the ISR (timeouts by the application)
+typedef struct gbp_link_stats_t
+{
+    uint32_t isr_calls;
+    uint32_t isr_cycles_max;
+    uint32_t isr_cycles[GBP_STATS_BINS];
+    uint32_t packets;         // queued for the application
+    uint32_t checksum_errors; // packets NAKed and thrown away, the gameboy sends them again
+    uint32_t packet_errors;   // payloads that did not fit
+    uint32_t timeouts;        // packets cut off by GBP_PACKET_TIMEOUT_MS
+    uint32_t realigns;        // byte frames thrown away by the SPI backend
+} gbp_link_stats_t;
+
+// Link cable pins of a port
+typedef struct gbp_link_pins_t
+{
+    uint8_t so; // Serial OUTPUT of the gameboy, read
+    uint8_t si; // Serial INPUT of the gameboy, driven
+    uint8_t sc; // Serial Clock
+} gbp_link_pins_t;
+
 // Printer Status and other stuff
 typedef struct gbp_printer_t
-{ // This is the overall information about the printer
+{ // This is the overall information about the printer, one for each link port
     bool initialized;
+    gbp_link_pins_t pins;
 
     gbp_printer_status_t gbp_printer_status;
     gbp_rx_tx_byte_buffer_t gbp_rx_tx_byte_buffer;
     gbp_packet_parser_t gbp_packet_parser;
     gbp_packet_t gbp_packet;
 
-    // Triggered upon successful read of a packet
-    bool packet_ready_flag;
+    // Successfully read packets, waiting to be processed
+    gbp_packet_ring_t gbp_packet_ring;
 
     // Buffers
     uint8_t gbp_print_settings_buffer[4];
-    uint8_t gbp_print_buffer[650]; // 640 bytes usually
+    uint8_t gbp_print_buffer[GBP_PACKET_BUFFER_SIZE]; // Scratch payload for packets that did not fit in the ring
 
-    // Timeout if bytes not received in time
-    unsigned long uptime_til_timeout_ms;
-    unsigned long uptime_til_pretend_print_finish_ms;
+    // Timeout if bytes not received in time, esp_timer_get_time() microseconds, the ISR can't rely on millis() being in IRAM
+    int64_t uptime_til_timeout_us;
+
+    gbp_link_stats_t gbp_link_stats;
 } gbp_printer_t;
 
 /*
     Global Vars
 */
-gbp_printer_t gbp_printer; // Overall Structure
+static const gbp_link_pins_t gbp_link_pins[] = {
+    {GBP_SO_PIN, GBP_SI_PIN, GBP_SC_PIN},
+    {GBP_SO_PIN_2, GBP_SI_PIN_2, GBP_SC_PIN_2}};
+
+gbp_printer_t gbp_printers[GBP_PORTS]; // Overall Structure of each emulated printer
 
 
 
@@ -157,7 +237,7 @@ gbp_printer_t gbp_printer; // Overall Structure
 /*------------------------- BYTE STREAMER ------------------------------------*/
 /******************************************************************************/
 
-static bool gbp_rx_tx_byte_reset(struct gbp_rx_tx_byte_buffer_t *ptr)
+static void IRAM_ATTR gbp_rx_tx_byte_reset(struct gbp_rx_tx_byte_buffer_t *ptr)
 {               // Resets the byte reader, back into scanning for the next packet.
     *ptr = {0}; // Clear
 
@@ -166,126 +246,140 @@ static bool gbp_rx_tx_byte_reset(struct gbp_rx_tx_byte_buffer_t *ptr)
     ptr->sync_word = GBP_SYNC_WORD;
 }
 
-static bool gbp_rx_tx_byte_set(struct gbp_rx_tx_byte_buffer_t *ptr, const uint8_t tx_byte)
+static void IRAM_ATTR gbp_rx_tx_byte_set(struct gbp_rx_tx_byte_buffer_t *ptr, const uint8_t tx_byte)
 { // Stages the next byte to be transmitted
     ptr->tx_byte_staging = tx_byte;
 }
 
-static bool gbp_rx_tx_byte_update(struct gbp_rx_tx_byte_buffer_t *ptr, uint8_t *rx_byte, int *rx_bitState)
+static bool IRAM_ATTR gbp_rx_tx_byte_update(struct gbp_rx_tx_byte_buffer_t *ptr, const uint8_t so_pin, uint8_t *rx_byte, int *rx_bitState)
 { // This is a byte scanner to allow this to read gameboy printer protocol formatted messages
+    // Only called on a rising clock, when the gameboy samples SI and SO is stable (Bit Rx Read)
     bool byte_ready = false;
 
-    int serial_clock_state = digitalRead(GBP_SC_PIN);
-    int serial_out_state = digitalRead(GBP_SO_PIN);
-
-    *rx_bitState = NO_NEW_BIT;
+    int serial_out_state = GBP_PIN_READ(so_pin);
 
     if (!(ptr->initialized))
-    { // Record initial clock pin state
+    {
         gbp_rx_tx_byte_reset(ptr);
-        ptr->initialized = true;
-        ptr->serial_clock_state_prev = serial_clock_state;
-        return byte_ready;
-    }
-
-    // Clock Edge Detection
-    if (serial_clock_state != ptr->serial_clock_state_prev)
-    { // Clock Pin Transition Detected
-
-        if (serial_clock_state)
-        { // Rising Clock (Bit Rx Read)
-
-            // Current Bit State (Useful for diagnostics)
-            *rx_bitState = serial_out_state;
-
-            // Is this syncronised to a byte frame yet?
-            if (!(ptr->syncronised))
-            { // Preamble Sync Scan
-
-                // The sync buffer is seen as a FIFO stream of bits
-                (ptr->sync_buffer) <<= 1;
-
-                // Push in a `1` else leave as `0`
-                if (serial_out_state)
-                {
-                    (ptr->sync_buffer) |= 1;
-                }
-
-                // Check if Sync Word is found
-                if (ptr->sync_buffer == ptr->sync_word)
-                { // Syncword detected
-                    ptr->syncronised = true;
-                    ptr->byte_frame_bit_pos = 7;
-                }
-            }
-            else
-            { // Byte Read Mode
-
-                if (serial_out_state)
-                { // Get latest incoming bit and insert to next bit position in a byte
-                    ptr->rx_byte_buffer |= (1 << ptr->byte_frame_bit_pos);
-                }
-
-                if (ptr->byte_frame_bit_pos > 0)
-                { // Need to read a few more bits to make a byte
-                    ptr->byte_frame_bit_pos--;
-                }
-                else
-                { // All bits in a byte frame has been received
-                    byte_ready = true;
-
-                    // Set Byte Result
-                    *rx_byte = ptr->rx_byte_buffer;
-
-                    // Reset Rx Buffer
-                    ptr->byte_frame_bit_pos = 7;
-                    ptr->rx_byte_buffer = 0;
-                }
-            }
+    }
+
+    // Current Bit State (Useful for diagnostics)
+    *rx_bitState = serial_out_state;
+
+    // Is this syncronised to a byte frame yet?
+    if (!(ptr->syncronised))
+    { // Preamble Sync Scan
+
+        // The sync buffer is seen as a FIFO stream of bits
+        (ptr->sync_buffer) <<= 1;
+
+        // Push in a `1` else leave as `0`
+        if (serial_out_state)
+        {
+            (ptr->sync_buffer) |= 1;
+        }
+
+        // Check if Sync Word is found
+        if (ptr->sync_buffer == ptr->sync_word)
+        { // Syncword detected
+            ptr->syncronised = true;
+            ptr->byte_frame_bit_pos = 7;
+        }
+    }
+    else
+    { // Byte Read Mode
+
+        if (serial_out_state)
+        { // Get latest incoming bit and insert to next bit position in a byte
+            ptr->rx_byte_buffer |= (1 << ptr->byte_frame_bit_pos);
+        }
+
+        if (ptr->byte_frame_bit_pos > 0)
+        { // Need to read a few more bits to make a byte
+            ptr->byte_frame_bit_pos--;
         }
         else
-        { // Falling Clock (Bit Tx Set)
-
-            if ((ptr->syncronised))
-                ;
-            { // Only start transmitting when syncronised
-
-                // Loading new TX Bytes on new byte frames
-                if (7 == ptr->byte_frame_bit_pos)
-                { // Start of a new byte cycle
-                    if (ptr->tx_byte_staging)
-                    { // Byte ready to be sent
-                        ptr->tx_byte_buffer = ptr->tx_byte_staging;
-                    }
-                    else
-                    { // No new bytes present. Just keep transmitting zeros.
-                        ptr->tx_byte_buffer = 0;
-                    }
-                }
-
-                // Send next bit in a byte
-                if (ptr->tx_byte_buffer & (1 << ptr->byte_frame_bit_pos))
-                { // Send High Bit
-                    digitalWrite(GBP_SI_PIN, HIGH);
-                }
-                else
-                { // Send Low Bit
-                    digitalWrite(GBP_SI_PIN, LOW);
-                }
-            }
+        { // All bits in a byte frame has been received
+            byte_ready = true;
+
+            // Set Byte Result
+            *rx_byte = ptr->rx_byte_buffer;
+
+            // Reset Rx Buffer
+            ptr->byte_frame_bit_pos = 7;
+            ptr->rx_byte_buffer = 0;
         }
     }
 
-    // Save current state for next edge detection
-    ptr->serial_clock_state_prev = serial_clock_state;
     return byte_ready;
 }
 
+static void IRAM_ATTR gbp_rx_tx_byte_drive(struct gbp_rx_tx_byte_buffer_t *ptr, const uint8_t si_pin)
+{ // Presents the next TX bit on SI, the gameboy samples it on the following rising clock
+    if (!(ptr->syncronised))
+    { // Only start transmitting when syncronised
+        GBP_PIN_LOW(si_pin);
+        return;
+    }
+
+    // Loading new TX Bytes on new byte frames
+    if (7 == ptr->byte_frame_bit_pos)
+    { // Start of a new byte cycle, zeros are sent if nothing was staged
+        ptr->tx_byte_buffer = ptr->tx_byte_staging;
+        ptr->tx_byte_staging = 0;
+    }
+
+    // Send next bit in a byte
+    if (ptr->tx_byte_buffer & (1 << ptr->byte_frame_bit_pos))
+    { // Send High Bit
+        GBP_PIN_HIGH(si_pin);
+    }
+    else
+    { // Send Low Bit
+        GBP_PIN_LOW(si_pin);
+    }
+}
+
+/******************************************************************************/
+/*------------------------- PACKET RING --------------------------------------*/
+/******************************************************************************/
+
+static gbp_packet_slot_t *IRAM_ATTR gbp_packet_ring_reserve(struct gbp_packet_ring_t *ring)
+{ // Producer: returns the slot to fill with the next packet, or NULL if the ring is full
+    if (((uint8_t)(ring->head - ring->tail)) >= GBP_PACKET_RING_SIZE)
+    {
+        return NULL;
+    }
+    return &(ring->slots[ring->head & (GBP_PACKET_RING_SIZE - 1)]);
+}
+
+static void IRAM_ATTR gbp_packet_ring_commit(struct gbp_packet_ring_t *ring)
+{ // Producer: publishes the reserved slot to the consumer
+    __sync_synchronize(); // slot contents must be visible before the new head
+    ring->head = ring->head + 1;
+}
+
+static gbp_packet_slot_t *gbp_packet_ring_peek(struct gbp_packet_ring_t *ring)
+{ // Consumer: returns the oldest received packet, or NULL if there is none
+    if (ring->head == ring->tail)
+    {
+        return NULL;
+    }
+    __sync_synchronize();
+    return &(ring->slots[ring->tail & (GBP_PACKET_RING_SIZE - 1)]);
+}
+
+static void gbp_packet_ring_pop(struct gbp_packet_ring_t *ring)
+{ // Consumer: releases the slot returned by gbp_packet_ring_peek()
+    __sync_synchronize(); // finish reading the slot before handing it back
+    ring->tail = ring->tail + 1;
+}
+
 /******************************************************************************/
 /*------------------------- MESSAGE PARSER -----------------------------------*/
 /******************************************************************************/
 
-static bool gbp_parse_message_reset(struct gbp_packet_parser_t *ptr)
+static void IRAM_ATTR gbp_parse_message_reset(struct gbp_packet_parser_t *ptr)
 {
     *ptr =
         {
@@ -293,266 +387,272 @@ static bool gbp_parse_message_reset(struct gbp_packet_parser_t *ptr)
             0};
 }
 
-static bool gbp_parse_message_update(
+static void IRAM_ATTR gbp_parse_payload_store(
+    struct gbp_packet_parser_t *ptr,
+    struct gbp_packet_t *packet_ptr,
+    struct gbp_printer_t *printer_ptr,
+    const uint8_t value,
+    uint16_t count)
+{ // Appends `count` copies of `value` to the payload, flags an error if they will not fit
+    if (count > (GBP_PACKET_BUFFER_SIZE - ptr->decoded_length))
+    {
+        if (ptr->decoded_length < GBP_PACKET_BUFFER_SIZE)
+        { // Counted once per packet
+            printer_ptr->gbp_link_stats.packet_errors++;
+        }
+        count = GBP_PACKET_BUFFER_SIZE - ptr->decoded_length;
+        printer_ptr->gbp_printer_status.packet_error = true;
+    }
+    memset(&(packet_ptr->data_ptr[ptr->decoded_length]), value, count);
+    ptr->decoded_length += count;
+}
+
+static void IRAM_ATTR gbp_parse_payload_rle(
+    struct gbp_packet_parser_t *ptr,
+    struct gbp_packet_t *packet_ptr,
+    struct gbp_printer_t *printer_ptr,
+    const uint8_t rx_byte)
+{ // Expands one byte of a compressed payload as it arrives
+    /*
+      Each block starts with a control byte:
+        0x00-0x7F : followed by (control + 1) literal bytes
+        0x80-0xFF : followed by one byte that is repeated (control - 0x80 + 2) times
+    */
+    if (ptr->rle_run)
+    { // Repeated byte
+        gbp_parse_payload_store(ptr, packet_ptr, printer_ptr, rx_byte, (ptr->rle_remaining & 0x7F) + 2);
+        ptr->rle_run = false;
+        ptr->rle_remaining = 0;
+    }
+    else if (ptr->rle_remaining > 0)
+    { // Literal byte
+        gbp_parse_payload_store(ptr, packet_ptr, printer_ptr, rx_byte, 1);
+        ptr->rle_remaining--;
+    }
+    else if (rx_byte & 0x80)
+    { // Run control byte, the count is kept in rle_remaining until the byte arrives
+        ptr->rle_run = true;
+        ptr->rle_remaining = rx_byte;
+    }
+    else
+    { // Literal control byte
+        ptr->rle_remaining = rx_byte + 1;
+    }
+}
+
+/*
+    Each state has a handler that consumes one byte, does the set up for the
+    state that follows (e.g. staging the next response byte) and returns it.
+*/
+typedef gbp_parse_state_t (*gbp_parse_handler_t)(
     struct gbp_packet_parser_t *ptr,   // Parser Variables
-    bool *packet_ready_flag,           // OUTPUT: Packet Ready Semaphore
     struct gbp_packet_t *packet_ptr,   // INPUT/OUTPUT: Packet Data Buffer
     struct gbp_printer_t *printer_ptr, // INPUT/OUTPUT: Printer Variables
-    const bool new_rx_byte,            // INPUT: New Incoming Byte Flag
     const uint8_t rx_byte,             // INPUT: New Incoming Byte Value
     bool *new_tx_byte,                 // OUTPUT: New Outgoing Byte Ready
     uint8_t *tx_byte                   // OUTPUT: New Outgoing Byte Value
-)
-{ // Return false if there was no error detected
-    bool error_status = false;
-    gbp_parse_state_t parse_state_prev = ptr->parse_state;
+);
 
-    *new_tx_byte = false;
+static gbp_parse_state_t IRAM_ATTR gbp_parse_command(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    packet_ptr->command = rx_byte;
 
-    //-------------------------- NEW BYTES
+    // Payload goes straight into the ring, or is thrown away and the packet NAKed if loop() is too slow
+    ptr->slot = gbp_packet_ring_reserve(&(printer_ptr->gbp_packet_ring));
 
-    if (new_rx_byte)
+    switch (packet_ptr->command)
     {
-        // This keeps track of each stage and how to handle each incoming byte
-        switch (ptr->parse_state)
-        {
-        case GBP_PARSE_STATE_COMMAND:
-        {
-            ptr->parse_state = GBP_PARSE_STATE_COMPRESSION;
-
-            packet_ptr->command = rx_byte;
-
-            switch (packet_ptr->command)
-            {
-            case GBP_COMMAND_INIT:
-                packet_ptr->data_ptr = NULL;
-                break;
-            case GBP_COMMAND_DATA:
-                packet_ptr->data_ptr = printer_ptr->gbp_print_buffer;
-                break;
-            case GBP_COMMAND_PRINT:
-                packet_ptr->data_ptr = printer_ptr->gbp_print_settings_buffer;
-                break;
-            case GBP_COMMAND_INQUIRY:
-                packet_ptr->data_ptr = NULL;
-                break;
-            default:
-                packet_ptr->data_ptr = NULL;
-            }
-
-            // Checksum Tally
-            ptr->calculated_checksum = 0; // Initialise Count
-            ptr->calculated_checksum += rx_byte;
-        }
+    case GBP_COMMAND_DATA:
+    case GBP_COMMAND_PRINT:
+        packet_ptr->data_ptr = (ptr->slot) ? ptr->slot->data : printer_ptr->gbp_print_buffer;
         break;
-        case GBP_PARSE_STATE_COMPRESSION:
-        {
-            ptr->parse_state = GBP_PARSE_STATE_DATA_LENGTH_LOW;
-            packet_ptr->compression = rx_byte;
+    default:
+        packet_ptr->data_ptr = NULL;
+    }
 
-            // Checksum Tally
-            ptr->calculated_checksum += rx_byte;
-        }
-        break;
-        case GBP_PARSE_STATE_DATA_LENGTH_LOW:
-        {
-            ptr->parse_state = GBP_PARSE_STATE_PACKET_DATA_LENGTH_HIGH;
-            packet_ptr->data_length |= ((rx_byte << 0) & 0x00FF);
+    // Checksum Tally
+    ptr->calculated_checksum = rx_byte; // Initialise Count
+    return GBP_PARSE_STATE_COMPRESSION;
+}
 
-            // Checksum Tally
-            ptr->calculated_checksum += rx_byte;
-        }
-        break;
-        case GBP_PARSE_STATE_PACKET_DATA_LENGTH_HIGH:
-        {
-            packet_ptr->data_length |= ((rx_byte << 8) & 0xFF00);
-
-            // Check data length
-            if (packet_ptr->data_length > 0)
-            {
-                if (packet_ptr->data_ptr == NULL)
-                { // SIMPLE ASSERT
-                    Serial.println("# ERROR: Serial data length should be non zero");
-                    while (1)
-                        ;
-                }
-                ptr->parse_state = GBP_PARSE_STATE_VARIABLE_PAYLOAD;
-            }
-            else
-            { // Skip variable payload stage if data_length is zero
-                ptr->parse_state = GBP_PARSE_STATE_CHECKSUM_LOW;
-            }
-
-            // Checksum Tally
-            ptr->calculated_checksum += rx_byte;
-        }
-        break;
-        case GBP_PARSE_STATE_VARIABLE_PAYLOAD:
-        {
-            /*
-          The logical flow of this section is similar to
-          `for (data_index = 0 ; (data_index > packet_ptr->data_length) ; data_index++ )`
-        */
-            // Record Byte
-            packet_ptr->data_ptr[ptr->data_index] = rx_byte;
-
-            // Checksum Tally
-            ptr->calculated_checksum += rx_byte;
-
-            // Increment to next byte position in the data field
-            ptr->data_index++;
-
-            // Escape and move to next stage
-            if (ptr->data_index > packet_ptr->data_length)
-            {
-                ptr->parse_state = GBP_PARSE_STATE_CHECKSUM_LOW;
-            }
-        }
-        break;
-        case GBP_PARSE_STATE_CHECKSUM_LOW:
-        {
-            ptr->parse_state = GBP_PARSE_STATE_CHECKSUM_HIGH;
-            packet_ptr->checksum = 0;
-            packet_ptr->checksum |= ((rx_byte << 0) & 0x00FF);
-            ptr->crc_low = rx_byte; // For debugging
-        }
-        break;
-        case GBP_PARSE_STATE_CHECKSUM_HIGH:
-        {
-            ptr->parse_state = GBP_PARSE_STATE_DEVICE_ID;
-            packet_ptr->checksum |= ((rx_byte << 8) & 0xFF00);
-            ptr->crc_high = rx_byte; // For debugging
-        }
-        break;
-        case GBP_PARSE_STATE_DEVICE_ID:
-        {
-            ptr->parse_state = GBP_PARSE_STATE_PRINTER_STATUS;
-        }
-        break;
-        case GBP_PARSE_STATE_PRINTER_STATUS:
-        {
-            ptr->parse_state = GBP_PARSE_STATE_PACKET_RECEIVED;
-        }
-        break;
-        case GBP_PARSE_STATE_PACKET_RECEIVED:
-        {
-        }
-        break;
-        case GBP_PARSE_STATE_DIAGNOSTICS:
-        {
-        }
-        break;
-        }
-    } // New Byte Detected
+static gbp_parse_state_t IRAM_ATTR gbp_parse_compression(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    packet_ptr->compression = rx_byte;
+    ptr->calculated_checksum += rx_byte;
+    return GBP_PARSE_STATE_DATA_LENGTH_LOW;
+}
 
-    //-------------------------- INIT FOR NEXT STAGE
-    /*
-    This section commonly deals with initialising the next parsing state.
-    e.g. Initialising variables in addition to also staging the next response byte.
-  */
+static gbp_parse_state_t IRAM_ATTR gbp_parse_data_length_low(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    packet_ptr->data_length = rx_byte;
+    ptr->calculated_checksum += rx_byte;
+    return GBP_PARSE_STATE_PACKET_DATA_LENGTH_HIGH;
+}
+
+static gbp_parse_state_t IRAM_ATTR gbp_parse_data_length_high(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    packet_ptr->data_length |= ((rx_byte << 8) & 0xFF00);
+    ptr->calculated_checksum += rx_byte;
+
+    // Check data length
+    if ((packet_ptr->data_length > GBP_PACKET_BUFFER_SIZE) ||
+        ((packet_ptr->data_length > 0) && (packet_ptr->data_ptr == NULL)))
+    { // Corrupted header, or a payload on a command that has none
+        packet_ptr->data_length = 0;
+        packet_ptr->compression = GBP_COMPRESSION_DISABLED;
+        printer_ptr->gbp_printer_status.packet_error = true;
+        printer_ptr->gbp_link_stats.packet_errors++;
+    }
+
+    ptr->data_index = 0;
+    ptr->decoded_length = 0;
+    ptr->rle_remaining = 0;
+    ptr->rle_run = false;
+
+    // Skip variable payload stage if data_length is zero
+    return (packet_ptr->data_length > 0) ? GBP_PARSE_STATE_VARIABLE_PAYLOAD : GBP_PARSE_STATE_CHECKSUM_LOW;
+}
+
+static gbp_parse_state_t IRAM_ATTR gbp_parse_variable_payload(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    ptr->calculated_checksum += rx_byte;
 
-    // Indicates if there was a change in state on last cycle
-    if (ptr->parse_state != parse_state_prev)
+    // Record Byte
+    if (GBP_COMPRESSION_DISABLED != packet_ptr->compression)
+    { // Expanded straight into the payload buffer, data_length counts wire bytes
+        gbp_parse_payload_rle(ptr, packet_ptr, printer_ptr, rx_byte);
+    }
+    else
+    { // data_length was checked against the buffer size already
+        packet_ptr->data_ptr[ptr->decoded_length++] = rx_byte;
+    }
+
+    // Escape and move to next stage
+    return (++(ptr->data_index) < packet_ptr->data_length) ? GBP_PARSE_STATE_VARIABLE_PAYLOAD : GBP_PARSE_STATE_CHECKSUM_LOW;
+}
+
+static gbp_parse_state_t IRAM_ATTR gbp_parse_checksum_low(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    packet_ptr->checksum = rx_byte;
+    ptr->crc_low = rx_byte; // For debugging
+    return GBP_PARSE_STATE_CHECKSUM_HIGH;
+}
+
+static gbp_parse_state_t IRAM_ATTR gbp_parse_checksum_high(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    packet_ptr->checksum |= ((rx_byte << 8) & 0xFF00);
+    ptr->crc_high = rx_byte; // For debugging
+
+    // Acknowledge while the gameboy sends the device id byte
+    *new_tx_byte = true;
+    *tx_byte = GBP_DEVICE_ID;
+    packet_ptr->acknowledgement = *tx_byte;
+    return GBP_PARSE_STATE_DEVICE_ID;
+}
+
+static gbp_parse_state_t IRAM_ATTR gbp_parse_device_id(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    // Checksum Verification
+    bool bad_checksum = (ptr->calculated_checksum != packet_ptr->checksum);
+    printer_ptr->gbp_printer_status.checksum_error = bad_checksum || (NULL == ptr->slot);
+    if (bad_checksum)
+    { // The status byte NAKs it, the printer state is left as it was for the retry
+        printer_ptr->gbp_link_stats.checksum_errors++;
+    }
+    else if (NULL == ptr->slot)
+    { // Ring was full, NAKed the same way so the gameboy sends it again instead of losing it
+        printer_ptr->gbp_packet_ring.dropped++;
+    }
+    else
     {
-        // This keeps track of each stage and how to handle each incoming byte
-        switch (ptr->parse_state)
-        {
-        case GBP_PARSE_STATE_COMMAND:
-        {
-        }
-        break;
-        case GBP_PARSE_STATE_COMPRESSION:
-        {
-        }
-        break;
-        case GBP_PARSE_STATE_DATA_LENGTH_LOW:
-        {
-            packet_ptr->data_length = 0;
-        }
-        break;
-        case GBP_PARSE_STATE_PACKET_DATA_LENGTH_HIGH:
-        {
-        }
-        break;
-        case GBP_PARSE_STATE_VARIABLE_PAYLOAD:
-        {
-            ptr->data_index = 0;
-        }
-        break;
-        case GBP_PARSE_STATE_CHECKSUM_LOW:
-        {
-        }
-        break;
-        case GBP_PARSE_STATE_CHECKSUM_HIGH:
+        switch (packet_ptr->command)
         {
+        case GBP_COMMAND_DATA:
+            printer_ptr->gbp_printer_status.unprocessed_data = true;
+            break;
+        case GBP_COMMAND_PRINT:
+            printer_ptr->gbp_printer_status.unprocessed_data = false;
+            printer_ptr->gbp_printer_status.print_buffer_full = true;
+            printer_ptr->gbp_printer_status.printer_busy = true; // cleared by the application when the print is done
+            break;
+        default:
+            break;
         }
-        break;
-        case GBP_PARSE_STATE_DEVICE_ID:
-        {
-            *new_tx_byte = true;
-            *tx_byte = GBP_DEVICE_ID;
+    }
 
-            packet_ptr->acknowledgement = *tx_byte;
-        }
-        break;
-        case GBP_PARSE_STATE_PRINTER_STATUS:
-        {
+    // Status goes out while the gameboy sends its status byte
+    *new_tx_byte = true;
+    *tx_byte = gbp_status_byte(&(printer_ptr->gbp_printer_status));
+    packet_ptr->printer_status = *tx_byte;
+    return GBP_PARSE_STATE_PRINTER_STATUS;
+}
 
-            // Checksum Verification
-            if (ptr->calculated_checksum == packet_ptr->checksum)
-            { // Checksum Passed
-                printer_ptr->gbp_printer_status.checksum_error = false;
-            }
-            else
-            { // Checksum Failed
-                printer_ptr->gbp_printer_status.checksum_error = true;
-            }
-
-            switch (packet_ptr->command)
-            {
-            case GBP_COMMAND_INIT:
-                break;
-            case GBP_COMMAND_DATA:
-                printer_ptr->gbp_printer_status.unprocessed_data = true;
-                break;
-            case GBP_COMMAND_PRINT:
-                printer_ptr->gbp_printer_status.unprocessed_data = false;
-                printer_ptr->gbp_printer_status.print_buffer_full = true;
-                printer_ptr->gbp_printer_status.printer_busy = true;
-
-                // pretend to print for 5 seconds or so
-                gbp_printer.uptime_til_pretend_print_finish_ms = millis() + GBP_PACKET_PRETEND_PRINT_TIME_MS;
-                break;
-            case GBP_COMMAND_INQUIRY:
-                break;
-            }
-
-            *new_tx_byte = true;
-            *tx_byte = gbp_status_byte(&(printer_ptr->gbp_printer_status));
-            packet_ptr->printer_status = *tx_byte;
-        }
-        break;
-        case GBP_PARSE_STATE_PACKET_RECEIVED:
-        {
-            *packet_ready_flag = true;
-        }
-        break;
-        case GBP_PARSE_STATE_DIAGNOSTICS:
-        {
-        }
-        break;
-        }
-    } // Init Next State
+static gbp_parse_state_t IRAM_ATTR gbp_parse_printer_status(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{
+    if (printer_ptr->gbp_printer_status.checksum_error)
+    { // NAKed (bad checksum or no room in the ring), the slot is not committed so none of the packet reaches loop()
+    }
+    else
+    { // Hand the packet over to loop(), with data_length now the expanded size
+        ptr->slot->packet = *packet_ptr;
+        ptr->slot->packet.data_length = ptr->decoded_length;
+        gbp_packet_ring_commit(&(printer_ptr->gbp_packet_ring));
+        printer_ptr->gbp_link_stats.packets++;
+    }
+    return GBP_PARSE_STATE_PACKET_RECEIVED;
+}
+
+static gbp_parse_state_t IRAM_ATTR gbp_parse_idle(struct gbp_packet_parser_t *ptr, struct gbp_packet_t *packet_ptr, struct gbp_printer_t *printer_ptr, const uint8_t rx_byte, bool *new_tx_byte, uint8_t *tx_byte)
+{ // Waiting for a reset
+    return ptr->parse_state;
+}
+
+// Indexed by gbp_parse_state_t, kept in DRAM so the ISR never reads it from flash
+static const gbp_parse_handler_t DRAM_ATTR gbp_parse_handlers[] =
+    {
+        gbp_parse_command,          // GBP_PARSE_STATE_COMMAND
+        gbp_parse_compression,      // GBP_PARSE_STATE_COMPRESSION
+        gbp_parse_data_length_low,  // GBP_PARSE_STATE_DATA_LENGTH_LOW
+        gbp_parse_data_length_high, // GBP_PARSE_STATE_PACKET_DATA_LENGTH_HIGH
+        gbp_parse_variable_payload, // GBP_PARSE_STATE_VARIABLE_PAYLOAD
+        gbp_parse_checksum_low,     // GBP_PARSE_STATE_CHECKSUM_LOW
+        gbp_parse_checksum_high,    // GBP_PARSE_STATE_CHECKSUM_HIGH
+        gbp_parse_device_id,        // GBP_PARSE_STATE_DEVICE_ID
+        gbp_parse_printer_status,   // GBP_PARSE_STATE_PRINTER_STATUS
+        gbp_parse_idle,             // GBP_PARSE_STATE_PACKET_RECEIVED
+        gbp_parse_idle              // GBP_PARSE_STATE_DIAGNOSTICS
+};
+
+static bool IRAM_ATTR gbp_parse_message_update(
+    struct gbp_packet_parser_t *ptr,   // Parser Variables
+    struct gbp_packet_t *packet_ptr,   // INPUT/OUTPUT: Packet Data Buffer
+    struct gbp_printer_t *printer_ptr, // INPUT/OUTPUT: Printer Variables
+    const bool new_rx_byte,            // INPUT: New Incoming Byte Flag
+    const uint8_t rx_byte,             // INPUT: New Incoming Byte Value
+    bool *new_tx_byte,                 // OUTPUT: New Outgoing Byte Ready
+    uint8_t *tx_byte                   // OUTPUT: New Outgoing Byte Value
+)
+{ // Return false if there was no error detected
+    *new_tx_byte = false;
 
-    return error_status;
+    if (new_rx_byte)
+    {
+        ptr->parse_state = gbp_parse_handlers[ptr->parse_state](ptr, packet_ptr, printer_ptr, rx_byte, new_tx_byte, tx_byte);
+    }
+
+    return false;
 }
 
 /*------------------------- Gameboy Printer --------------------------*/
 
-static bool gbp_printer_init(struct gbp_printer_t *ptr)
+static void gbp_printer_init(struct gbp_printer_t *ptr)
 {
     ptr->initialized = true;
     ptr->gbp_printer_status = {0};
+    ptr->gbp_packet_ring.head = 0;
+    ptr->gbp_packet_ring.tail = 0;
+    ptr->gbp_packet_ring.dropped = 0;
+    ptr->gbp_link_stats = {0};
 
     gbp_rx_tx_byte_reset(&(ptr->gbp_rx_tx_byte_buffer));
     gbp_parse_message_reset(&(ptr->gbp_packet_parser));
@@ -561,71 +661,276 @@ static bool gbp_printer_init(struct gbp_printer_t *ptr)
 /**************************************************************
  **************************************************************/
 
-void serialClock_ISR(void)
-{
-    int rx_bitState;
-
-    uint8_t rx_byte;
-    bool new_rx_byte;
+static void IRAM_ATTR gbp_link_stats_isr(struct gbp_link_stats_t *stats, const uint32_t start_cycles)
+{ // Called at the end of the link ISR
+    uint32_t cycles = ESP.getCycleCount() - start_cycles;
+    uint8_t bin = cycles ? 32 - __builtin_clz(cycles) : 0;
+    stats->isr_calls++;
+    stats->isr_cycles[(bin < GBP_STATS_BINS) ? bin : GBP_STATS_BINS - 1]++;
+    if (cycles > stats->isr_cycles_max)
+    {
+        stats->isr_cycles_max = cycles;
+    }
+}
 
+static void IRAM_ATTR gbp_link_process(struct gbp_printer_t *printer, const bool new_rx_byte, const uint8_t rx_byte)
+{ // Feeds the parser and stages its reply, shared by both link backends
     uint8_t tx_byte;
     bool new_tx_byte;
 
-    /***************** BYTE PARSER ***********************/
-
-    new_rx_byte = gbp_rx_tx_byte_update(&(gbp_printer.gbp_rx_tx_byte_buffer), &rx_byte, &rx_bitState);
-
     if (new_rx_byte)
     {
         // Update Timeout State
-        if (gbp_printer.gbp_rx_tx_byte_buffer.syncronised)
+        if (printer->gbp_rx_tx_byte_buffer.syncronised)
         { // Push forward timeout since a byte was received.
-            gbp_printer.uptime_til_timeout_ms = millis() + GBP_PACKET_TIMEOUT_MS;
+            printer->uptime_til_timeout_us = esp_timer_get_time() + GBP_PACKET_TIMEOUT_MS * 1000LL;
         }
     }
 
-    /***************** TX/RX BIT->BYTE DIAGNOSTICS ***********************/
-
     /***************** PACKET PARSER ***********************/
 
     gbp_parse_message_update(
-        &(gbp_printer.gbp_packet_parser),
-        &gbp_printer.packet_ready_flag,
-        &(gbp_printer.gbp_packet),
-        &(gbp_printer),
+        &(printer->gbp_packet_parser),
+        &(printer->gbp_packet),
+        printer,
         new_rx_byte, rx_byte,
         &new_tx_byte, &tx_byte);
 
+    if (GBP_PARSE_STATE_PACKET_RECEIVED == printer->gbp_packet_parser.parse_state)
+    { // Packet queued, scan for the next one straight away
+        gbp_rx_tx_byte_reset(&(printer->gbp_rx_tx_byte_buffer));
+        gbp_parse_message_reset(&(printer->gbp_packet_parser));
+    }
+
     /***************** TX BYTE SET ***********************/
 
     // Byte to be tranmitted to the gameboy received
     if (new_tx_byte)
     {
-        gbp_rx_tx_byte_set(&(gbp_printer.gbp_rx_tx_byte_buffer), tx_byte);
+        gbp_rx_tx_byte_set(&(printer->gbp_rx_tx_byte_buffer), tx_byte);
+    }
+}
+
+#if !GBP_LINK_SPI_SLAVE
+
+void IRAM_ATTR serialClock_ISR(void *arg)
+{ // Runs from IRAM on every rising clock, so flash cache misses cannot delay the next bit
+    // arg is the port's gbp_printer_t, each port is attached with its own
+    struct gbp_printer_t *printer = (struct gbp_printer_t *)arg;
+    uint32_t start_cycles = ESP.getCycleCount();
+    int rx_bitState;
+
+    uint8_t rx_byte;
+    bool new_rx_byte;
+
+    /***************** BYTE PARSER ***********************/
+
+    if (!GBP_PIN_READ(printer->pins.sc))
+    { // Glitch, the clock is not high anymore
+        return;
+    }
+
+    new_rx_byte = gbp_rx_tx_byte_update(&(printer->gbp_rx_tx_byte_buffer), printer->pins.so, &rx_byte, &rx_bitState);
+
+    gbp_link_process(printer, new_rx_byte, rx_byte);
+
+    // Next bit, a freshly staged byte starts going out straight away
+    gbp_rx_tx_byte_drive(&(printer->gbp_rx_tx_byte_buffer), printer->pins.si);
+
+    gbp_link_stats_isr(&(printer->gbp_link_stats), start_cycles);
+}
+
+static void gbp_link_setup(struct gbp_printer_t *printer)
+{
+    pinMode(printer->pins.si, OUTPUT);
+
+    /* Default link serial out pin state */
+    digitalWrite(printer->pins.si, LOW);
+
+    /* attach ISR, the port is its argument */
+    attachInterruptArg(digitalPinToInterrupt(printer->pins.sc), serialClock_ISR, printer, RISING); // attach interrupt handler, bits are sampled and driven on the rising clock
+}
+
+void gameboy_printer_link_update(struct gbp_printer_t *printer)
+{ // Nothing to do, every bit is handled by the ISR
+}
+
+#else
+
+/******************************************************************************/
+/*------------------------- SPI SLAVE LINK -----------------------------------*/
+/******************************************************************************/
+/*
+    The ESP32 SPI slave only finishes a transaction when CS goes high, and the
+    link cable has no CS line. A pulse counter counts rising clocks instead and
+    interrupts after every 8th one. The ISR then pulses the CS input through the
+    GPIO matrix, takes the byte, and arms the next one-byte transaction with the
+    reply (mode 3: clock idles high, bits are sampled on the rising edge).
+
+    DMA is not used: every reply depends on the byte just received, and one
+    byte transactions fit in the SPI data registers.
+
+    Bytes are framed by the counter, not by the sync word. A partial byte left
+    in the counter when the link goes idle is cleared by gameboy_printer_link_update().
+*/
+
+#define GBP_SPI (SPI3)                   // VSPI
+#define GBP_SPI_PCNT_UNIT PCNT_UNIT_0    // Counts SC rising edges
+#define GBP_SPI_PCNT_FILTER 100          // APB cycles (1.25us), ignores glitches shorter than this
+#define GBP_SPI_CS_LOW 0x30              // GPIO matrix input that is always low
+#define GBP_SPI_CS_HIGH 0x38             // GPIO matrix input that is always high
+
+static void IRAM_ATTR gbp_link_spi_arm(const uint8_t tx_byte)
+{ // Starts a new one byte transaction, tx_byte goes out during the next 8 clocks
+    GBP_SPI.slave.sync_reset = 1;
+    GBP_SPI.slave.sync_reset = 0;
+    GBP_SPI.slave.trans_done = 0;
+    GBP_SPI.slv_wrbuf_dlen.bit_len = 7;
+    GBP_SPI.slv_rdbuf_dlen.bit_len = 7;
+    GBP_SPI.mosi_dlen.usr_mosi_dbitlen = 7;
+    GBP_SPI.miso_dlen.usr_miso_dbitlen = 7;
+    GBP_SPI.data_buf[0] = tx_byte;
+    GBP_SPI.cmd.usr = 1;
+    pinMatrixInAttach(GBP_SPI_CS_LOW, VSPICS0_IN_IDX, false);
+}
+
+static void IRAM_ATTR gbp_link_spi_byte_ISR(void *arg)
+{ // Runs from IRAM once per byte, after the 8th rising clock, arg is the port's gbp_printer_t
+    uint32_t start_cycles = ESP.getCycleCount();
+    struct gbp_printer_t *printer = (struct gbp_printer_t *)arg;
+    struct gbp_rx_tx_byte_buffer_t *ptr = &(printer->gbp_rx_tx_byte_buffer);
+    bool new_rx_byte = false;
+    uint8_t rx_byte;
+
+    // End of the transaction
+    pinMatrixInAttach(GBP_SPI_CS_HIGH, VSPICS0_IN_IDX, false);
+    rx_byte = GBP_SPI.data_buf[0] & 0xFF;
+
+    if (!(ptr->initialized))
+    {
+        gbp_rx_tx_byte_reset(ptr);
+    }
+
+    if (!(ptr->syncronised))
+    { // Preamble Sync Scan, a byte at a time
+        ptr->sync_buffer = (ptr->sync_buffer << 8) | rx_byte;
+        if (ptr->sync_buffer == ptr->sync_word)
+        { // Syncword detected
+            ptr->syncronised = true;
+        }
+    }
+    else
+    {
+        new_rx_byte = true;
     }
 
-    /***************** TX BYTE SET DIAGNOSTICS ***********************/
+    gbp_link_process(printer, new_rx_byte, rx_byte);
+
+    // Like the bit-banged streamer, zeros are sent if nothing was staged
+    gbp_link_spi_arm(ptr->syncronised ? ptr->tx_byte_staging : 0);
+    ptr->tx_byte_staging = 0;
+
+    gbp_link_stats_isr(&(printer->gbp_link_stats), start_cycles);
+}
+
+static void gbp_link_spi_realign()
+{ // Throws away a partial byte, the next clock starts a new byte frame
+    pcnt_counter_pause(GBP_SPI_PCNT_UNIT);
+    pcnt_counter_clear(GBP_SPI_PCNT_UNIT);
+    pinMatrixInAttach(GBP_SPI_CS_HIGH, VSPICS0_IN_IDX, false);
+    gbp_link_spi_arm(0);
+    pcnt_counter_resume(GBP_SPI_PCNT_UNIT);
 }
 
+static void gbp_link_setup(struct gbp_printer_t *printer)
+{
+    pcnt_config_t pcnt_config = {0};
+
+    /* Pins from gameboy link cable, SC also feeds the pulse counter */
+    pinMatrixInAttach(printer->pins.sc, VSPICLK_IN_IDX, false);
+    pinMatrixInAttach(printer->pins.so, VSPID_IN_IDX, false);
+    pinMatrixOutAttach(printer->pins.si, VSPIQ_OUT_IDX, false, false);
+    pinMatrixInAttach(GBP_SPI_CS_HIGH, VSPICS0_IN_IDX, false);
+
+    /* Slave, full duplex, MSB first, mode 3 */
+    periph_module_enable(PERIPH_VSPI_MODULE);
+    GBP_SPI.slave.val = 0;
+    GBP_SPI.pin.val = 0;
+    GBP_SPI.user.val = 0;
+    GBP_SPI.ctrl.val = 0;
+    GBP_SPI.ctrl2.val = 0;
+    GBP_SPI.slave.slave_mode = 1;
+    GBP_SPI.user.doutdin = 1;
+    GBP_SPI.user.usr_mosi = 1;
+    GBP_SPI.user.usr_miso = 1;
+    GBP_SPI.pin.ck_idle_edge = 1;
+    GBP_SPI.user.ck_i_edge = 0;
+    GBP_SPI.ctrl2.miso_delay_mode = 1;
+
+    /* Byte framing */
+    pcnt_config.pulse_gpio_num = printer->pins.sc;
+    pcnt_config.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+    pcnt_config.lctrl_mode = PCNT_MODE_KEEP;
+    pcnt_config.hctrl_mode = PCNT_MODE_KEEP;
+    pcnt_config.pos_mode = PCNT_COUNT_INC;
+    pcnt_config.neg_mode = PCNT_COUNT_DIS;
+    pcnt_config.counter_h_lim = 8;
+    pcnt_config.counter_l_lim = 0;
+    pcnt_config.unit = GBP_SPI_PCNT_UNIT;
+    pcnt_config.channel = PCNT_CHANNEL_0;
+    pcnt_unit_config(&pcnt_config);
+    pcnt_set_filter_value(GBP_SPI_PCNT_UNIT, GBP_SPI_PCNT_FILTER);
+    pcnt_filter_enable(GBP_SPI_PCNT_UNIT);
+    pcnt_event_enable(GBP_SPI_PCNT_UNIT, PCNT_EVT_H_LIM);
+    pcnt_isr_service_install(ESP_INTR_FLAG_IRAM);
+    pcnt_isr_handler_add(GBP_SPI_PCNT_UNIT, gbp_link_spi_byte_ISR, printer);
+
+    gbp_link_spi_realign();
+}
+
+void gameboy_printer_link_update(struct gbp_printer_t *printer)
+{ // Call from loop(), realigns byte frames when the link stops halfway through a byte
+    // The SPI backend has a single port, so the counter state can be static
+    static int16_t count_prev = 0;
+    static unsigned long count_since_ms = 0;
+    int16_t count;
+
+    pcnt_get_counter_value(GBP_SPI_PCNT_UNIT, &count);
+    if ((0 == count) || (count != count_prev))
+    {
+        count_prev = count;
+        count_since_ms = millis();
+    }
+    else if (millis() - count_since_ms > GBP_PACKET_TIMEOUT_MS)
+    {
+        gbp_link_spi_realign();
+        printer->gbp_link_stats.realigns++;
+        count_prev = 0;
+    }
+}
+
+#endif // GBP_LINK_SPI_SLAVE
+
 void gameboy_printer_setup()
 {
 
     // Config Serial
     // Has to be fast or it will not trasfer the image fast enough to the computer
-  
-    /* Pins from gameboy link cable */
-    pinMode(GBP_SC_PIN, INPUT);
-    pinMode(GBP_SO_PIN, INPUT);
-    pinMode(GBP_SI_PIN, OUTPUT);
 
-    /* Default link serial out pin state */
-    digitalWrite(GBP_SI_PIN, LOW);
+    for (uint8_t port = 0; port < GBP_PORTS; port++)
+    {
+        struct gbp_printer_t *printer = &(gbp_printers[port]);
+        printer->pins = gbp_link_pins[port];
 
+        /* Pins from gameboy link cable */
+        pinMode(printer->pins.sc, INPUT);
+        pinMode(printer->pins.so, INPUT);
 
-    /* Clear Byte Scanner and Parser */
-    gbp_printer_init(&gbp_printer);
+        /* Clear Byte Scanner and Parser */
+        gbp_printer_init(printer);
 
-    /* attach ISR */
-    attachInterrupt(digitalPinToInterrupt(GBP_SC_PIN), serialClock_ISR, CHANGE); // attach interrupt handler
+        /* Start receiving */
+        gbp_link_setup(printer);
+    }
 } 
 
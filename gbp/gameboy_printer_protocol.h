@@ -144,7 +144,8 @@ typedef struct gbp_printer_status_t
 *******************************************************************************/
 #include <stdint.h> // uint8_t
 
-inline uint8_t gbp_status_byte(struct gbp_printer_status_t *printer_status_ptr)
+// Always inlined, it is called from the link ISR, which must not run code from flash
+__attribute__((always_inline)) inline uint8_t gbp_status_byte(struct gbp_printer_status_t *printer_status_ptr)
 { // This is returns a gameboy printer status byte
   //(Based on description in http://gbdev.gg8.se/wiki/articles/Gameboy_Printer )
 
@@ -95,9 +95,17 @@
  */
 
 #include "gbp/gameboy_printer.cpp"
+#include "escpos/bitscale.h"
+#include "escpos/raster.h"
+#include "escpos/profile.h"
+#include "archive/png.h"
 #include "test_image_custom_frame.h"
 
 #include "BluetoothSerial.h"
+#include <Preferences.h>
+#include <SD.h>
+#include <SPI.h>
+#include <freertos/stream_buffer.h>
 
 
 // PINS (Arduino Nano Every)
@@ -117,10 +125,85 @@
 #define EPSON_BYTES_PER_LINE 20
 
 // BUFFER OPTIONS
-#define BUFFER_SIZE 2880
-byte printBuffer[BUFFER_SIZE]; // buffer stores data as raster bitmap, in rows
-unsigned int totalBytes = 0;   // bytes recieved from GameBoy
-#define LINES_AT_ONCE_XL 12    // if your printer wont print the whole image, try values: 36, 24, 16
+// images are stored as 2bpp color rows (see escpos/raster.h), in strips of one data packet each,
+// so their height is only limited by the strip pool
+#define BUFFER_SIZE 2880           // one camera frame, 1bpp
+#define ROW_BYTES (IMG_WIDTH / 4)  // stored row, 2 bits per pixel
+#define STRIP_ROWS 16              // rows in one data packet
+#define STRIP_BYTES (STRIP_ROWS * ROW_BYTES)
+#define STRIP_POOL_SIZE 18         // strips allocated in DRAM (2 camera frames)
+#define PSRAM_STRIP_POOL_SIZE 1024 // strips allocated in PSRAM, if the board has it
+#define STRIP_LOW_WATER 9          // free strips below which printed rows are given back
+#define STRIP_WAIT_MS 200          // how long loop() waits for the print task to give back strips
+#define PRINT_THRESHOLD 2        // default threshold, shades (0-3, after the palette) from this one up are printed black without dithering
+
+// PRINT WORKER
+#define PRINT_QUEUE_LENGTH ((PRINT_TILES_MAX + 1) * GBP_PORTS) // images waiting for the printers, or held to print side by side
+#define PRINT_TASK_STACK_SIZE 4096
+#define PRINT_TASK_PRIORITY 1
+#define STREAM_TIMEOUT_MS 2000   // a streamed image without new data for this long is printed as it is
+#define PRINTER_STATUS_QUERY 0          // ask the printer with DLE EOT if it is still busy after a print
+#define PRINTER_STATUS_TIMEOUT_MS 500   // no answer to DLE EOT for this long, the printer is taken as ready
+#define PRINTER_OFFLINE_WAIT_MS 10000   // longest wait for a printer that reports being offline
+#define PRINT_TILES_MAX 3               // images printed side by side across the head, see "tiles"
+#define TILE_WAIT_MS 5000               // longest wait for the next image of a row of tiles, what arrived is printed then
+
+// PRINT CACHE, the ESC/POS of recent prints is kept so copies and reprints are sent without encoding
+#define CACHE_SLOTS 1              // prints kept
+#define CACHE_SLOT_SIZE 16384      // bytes per print, a 2x ESC * print is about 12 KB, larger ones are encoded every time
+#define PSRAM_CACHE_SLOTS 16       // if the board has PSRAM
+#define PSRAM_CACHE_SLOT_SIZE 65536
+
+// PRINTER PROFILE, used for printers without a saved one (see escpos/profile.h)
+#define PROFILE_HEAD_DOTS 384                    // 58 mm head
+#define PROFILE_COMMANDS PROFILE_ESC_ASTERISK    // add PROFILE_GS_V0 and PROFILE_GS_L if the printer takes them
+#define PROFILE_MAX_PAYLOAD 2880                 // if your printer wont print the whole image, try values: 2160, 1440, 960
+#define PROFILE_LINE_SPACING 24
+#define PROFILE_BAND_FEED 2
+#define PROFILE_BAND_DELAY_MS 0
+#define CALIBRATION_PAYLOADS 5760, 2880, 1440, 960 // tried by calibrate(), largest first so it wins a tie
+
+// SD ARCHIVE
+#define SD_ARCHIVE 0                 // save every image to a MicroSD card, as the packets received and as a PNG
+#define SD_CS_PIN 15                 // the card is on HSPI, the link uses the VSPI pins
+#define SD_SCK_PIN 14
+#define SD_MISO_PIN 12               // GPIO 12 must not be pulled high while booting
+#define SD_MOSI_PIN 13
+#define SD_FREQUENCY 20000000
+#define ARCHIVE_BUFFER_SIZE 8192     // packets waiting for the archive task, more are dropped
+#define ARCHIVE_BLOCK_SIZE 4096      // bytes per SD write, a multiple of the 512 byte sector
+#define ARCHIVE_TASK_STACK_SIZE 4096
+#define ARCHIVE_TASK_PRIORITY 0      // only runs while the print task and loop() wait
+
+// POWER, the clock is lowered between prints, see updatePower()
+#define IDLE_AFTER_MS 10000 // no link traffic and nothing to print for this long, the board idles
+#define ACTIVE_CPU_MHZ 240
+#define IDLE_CPU_MHZ 80     // lowest clock Bluetooth runs at, the link ISR still keeps up with it
+#define IDLE_LIGHT_SLEEP 0  // also light sleep while no printer is connected, woken by the link clock
+                            // waking takes about a millisecond, the Game Boy's first packet may be lost
+#define IDLE_SLEEP_MS 1000  // longest light sleep, bluetoothTask gets to retry the printer in between
+#define POWER_ACTIVE_MA 100 // rough currents of each state for the budget in "stats", measure your board
+#define POWER_IDLE_MA 40
+#define POWER_SLEEP_MA 2
+
+// STATS
+#define STATS_BINS 16 // time histograms, bin n counts times under 2^n us (the last one the rest)
+
+// BUTTON
+#define BUTTON_DEBOUNCE_MS 50 // shorter presses are ignored
+#define BUTTON_HOLD_MS 1000   // held this long, the last image is reprinted at the other scale
+                              // held while booting, the printer is calibrated
+
+// BLUETOOTH OUTPUT
+#define EPSON_FLUSH_SIZE 512 // bytes staged per SerialBT write, keep it below the printer's receive buffer
+#define BT_RETRY_MS 1000         // first reconnect delay, doubled after every failed attempt
+#define BT_RETRY_MAX_MS 30000
+#define BT_CHECK_MS 1000         // how often a connected link is checked, a disconnect wakes the task sooner
+#define BT_KEEPALIVE_MS 60000    // idle time after which a status request keeps the printer from dropping the link
+#define BT_PRINT_TRIES 3         // prints cut short by a disconnect are sent again, if the rows were kept
+#define BT_CACHE_CHANNEL 1       // reconnect on the SPP channel found last time, without a service search (arduino-esp32 2.0.7 or later)
+#define BT_TASK_STACK_SIZE 4096
+#define BT_TASK_PRIORITY 1
 
 // SETTINGS
 #define SLOW_BAUD_RATE 9600
@@ -128,19 +211,26 @@ unsigned int totalBytes = 0;   // bytes recieved from GameBoy
 #define PARTIAL_CUT 66
 #define FULL_CUT 65
 #define PC_BAUD_RATE 115200
-#define ESC_PRINT_METHOD 1
-#define GS_PRINT_METHOD 0
+#define COMMAND_LENGTH 32 // longest serial command line
 
-byte scale = 3;                          // DIP switch 1
+byte scale = 2;                          // DIP switch 1, the largest scale below it is used if the head is too narrow, 0 fits the head
+byte tiles = 1;                          // images printed side by side, as many as fit the head at scale 1 or more
+byte copies = 1;                         // prints of every image received
 byte cut = false;                        // DIP switch 2
 unsigned long baudRate = FAST_BAUD_RATE; // DIP switch 3
-byte method = ESC_PRINT_METHOD;          // DIP switch 4
 byte cutMode = FULL_CUT;                 // full cut is not supported by TM88, but works with other
+bool streamPrint = true;                 // start printing while the image is still being received
+byte dither = DITHER_NONE;               // DITHER_BAYER or DITHER_DIFFUSION print the palette's grays, see the "dither" command
+byte threshold = PRINT_THRESHOLD;        // used when not dithering
 
 // DEBUG STUFF
 #define COPY_TEST_IMAGE_TO_BUFFER 0
-#define SEND_TO_PC_AFTER_PRINTING 0
+#define SEND_TO_PC_AFTER_PRINTING 0 // binary frame of every print, read by tools/gbpxl_dump.py
+#define PC_DUMP_BAUD_RATE 921600    // Serial speed used instead of PC_BAUD_RATE when sending to the PC
+#define PC_DUMP_BPP 2               // 2: colors as received, 1: dots as printed at scale 1
 #define STARTUP_PRINTER_TEST 0
+#define DECODER_BENCHMARK 0
+#define PARSER_BENCHMARK 0
 
 
 
@@ -148,24 +238,209 @@ byte cutMode = FULL_CUT;                 // full cut is not supported by TM88, b
 BluetoothSerial SerialBT;
 char *pin = "0000";
 //SerialBT=Serial1;
-uint8_t btaddress[6]  = {0x66, 0x22, 0x62, 0xF5, 0x2F, 0x72};
+#define PRINTERS 1 // paired printers, every image goes to the one with the fewest waiting
+uint8_t btaddress[PRINTERS][6]  = {{0x66, 0x22, 0x62, 0xF5, 0x2F, 0x72}};
 //String btname = "MTP-2";
 
+// Every received image is a job, the link keeps receiving the next one
+// while the print task pushes the previous one over Bluetooth
+// When streaming, the job is queued with the first rows and filled as they arrive
+typedef enum print_job_state_t
+{
+    JOB_FREE = 0,  // no strips
+    JOB_RECEIVING, // filled by loop(), not queued yet
+    JOB_QUEUED,    // owned by the print task, loop() still adds rows until complete
+    JOB_HELD,      // complete, held by the print task until the images printed beside it arrive
+    JOB_PRINTED    // strips kept for a reprint
+} print_job_state_t;
+
+typedef struct print_job_t
+{
+    byte **strips;                  // row y is in strips[(y / STRIP_ROWS) % stripPoolSize]
+    volatile unsigned int rows;     // rows received so far
+    volatile unsigned int firstRow; // rows before this one were given back to the pool
+    volatile bool complete;         // no more rows are coming
+    bool calibrate;                 // test image for calibrate(), printed once for every setting tried
+    byte palette;                   // from the PRINT packet, the previous one while streaming
+    byte copies;                    // times the print task prints it
+    byte port;                      // link port it came from
+    byte printer;                   // index in printers, chosen when queued
+    uint32_t hash;                  // CRC-32 of the rows so far, finds the job's prints in the cache
+    volatile print_job_state_t state;
+} print_job_t;
+
+// A Game Boy on a link port (see GBP_PORTS), each one sends its own images
+typedef struct link_port_t
+{
+    gbp_printer_t *printer;
+    print_job_t *receiveJob; // image being received
+    unsigned long lastDataTime;
+    unsigned int dataPackets; // DATA packets of the image taken so far, a NAKed one is not counted until resent
+    uint32_t droppedPackets;  // last reported
+    uint32_t checksumErrors;  // last reported
+} link_port_t;
+
+// A paired printer, the print task connects to them in turn
+// Images waiting is queued - printed, each counter has a single writer
+typedef struct bt_printer_t
+{
+    const uint8_t *address;
+    printer_profile_t profile; // as saved in NVS, under profileLock, the print task works on a copy
+    volatile uint32_t queued;  // images routed to it, by loop()
+    volatile uint32_t printed; // by the print task
+} bt_printer_t;
+
+// Encoders, the fastest one the printer profile allows is used for each print
+typedef struct print_encoder_t
+{
+    const char *name;
+    byte command;          // PROFILE_*
+    byte scale;
+    unsigned int rowBytes; // sent for every image row, the fewer the faster
+    void (*print)(print_job_t *job);
+} print_encoder_t;
+
+// Idle governor states, see updatePower()
+typedef enum power_state_t
+{
+    POWER_ACTIVE = 0, // full clock
+    POWER_IDLE,       // IDLE_CPU_MHZ, loop() yields between polls
+    POWER_SLEEP,      // light sleep
+    POWER_STATES
+} power_state_t;
+
+// Time spent in a stage, see statsRecord()
+typedef struct stats_timer_t
+{
+    uint32_t count;
+    uint32_t maxUs;
+    uint64_t totalUs;
+    uint32_t bins[STATS_BINS];
+} stats_timer_t;
+
+typedef struct stats_t
+{
+    stats_timer_t receive; // recieveData(), per DATA packet
+    stats_timer_t band;    // encoding a band, without Bluetooth writes and waits for rows
+    stats_timer_t btWrite; // SerialBT.write(), per flush, the long ones are the printer stalling
+    stats_timer_t job;     // print(), per job
+    stats_timer_t wake;    // first link traffic while idle until full clock
+    uint32_t jobs;
+    uint32_t lastJobBytes;
+    uint32_t lastJobBytesPerSecond;
+    uint32_t cacheHits;      // prints sent from the cache
+    uint32_t archived;       // images saved to SD
+    uint32_t archiveDropped; // packets the archive task had no room for
+    uint32_t powerMs[POWER_STATES]; // time in each state, for the current budget
+    uint32_t lightSleeps;
+} stats_t;
+
+// ESC/POS of one print, see cacheKey()
+typedef struct cache_slot_t
+{
+    uint32_t key;      // 0 if empty or being filled
+    uint32_t length;   // bytes
+    uint32_t lastUsed; // cacheClock when last printed, the oldest slot is reused
+    byte *data;        // cacheSlotSize bytes
+} cache_slot_t;
+
+// File written through a block buffer, so the card only sees whole blocks
+typedef struct archive_file_t
+{
+    File file;
+    byte *block;         // ARCHIVE_BLOCK_SIZE bytes
+    unsigned int length; // staged in block
+} archive_file_t;
 
+// Image being archived from one link port, so two Game Boys get files of their own
+typedef struct archive_image_t
+{
+    archive_file_t raw;   // NNNNN.bin
+    archive_file_t image; // NNNNN.png
+    png_t png;
+    bool open;
+} archive_image_t;
+
+print_job_t printJobs[PRINT_QUEUE_LENGTH];
+QueueHandle_t printQueue; // jobs ready to print, filled by loop()
+QueueHandle_t stripPool;  // free strips
+unsigned int stripPoolSize = 0;
+TaskHandle_t printTaskHandle;
+TaskHandle_t bluetoothTaskHandle;
+volatile bool btConnected = false;       // set by bluetoothTask, cleared by the SPP close event too
+volatile unsigned int btConnections = 0; // successful connects since boot
+volatile byte btChannel = 0;             // SPP channel found by the last service search, 0 if none
+volatile bool btConnecting = false;      // bluetoothTask is in connect(), the board must not sleep
+unsigned long bootReadyMs = 0;           // millis() when setup() was done, the link takes prints from then on
+volatile unsigned long bootPrinterMs = 0; // millis() when the first printer was connected
+bool printLost = false;                  // a write failed since the print began, only used by the print task
+link_port_t ports[GBP_PORTS];
+print_job_t *lastJob = NULL; // last image received, for the reprint button
+bt_printer_t printers[PRINTERS];
+volatile byte activePrinter = 0; // printer the print task sends to, the profile commands change
+volatile byte btPrinter = 0;     // printer SerialBT is connected to, set by bluetoothTask
+
+byte epsonTxBuffer[EPSON_FLUSH_SIZE]; // staged ESC/POS output, only used by one task at a time
+unsigned int epsonTxLength = 0;
+unsigned long epsonTxBytes = 0; // sent since boot
+
+raster_t raster; // rasterizer of the job being printed, only used by the print task
+const print_encoder_t *encoder = NULL; // encoder of the job being printed, only used by the print task
+
+cache_slot_t cacheSlots[PSRAM_CACHE_SLOTS];
+unsigned int cacheSlotCount = 0;
+unsigned int cacheSlotSize = 0;
+uint32_t cacheClock = 0;
+cache_slot_t *cacheFill = NULL; // slot epson_flush() copies to, only used by the print task
+
+Preferences preferences; // "profiles" namespace, under profileLock
+SemaphoreHandle_t profileLock = NULL; // held to read or change printers[].profile and to save them
+stats_t stats;
+unsigned long bandStartUs = 0; // print task only, see finishBand()
+unsigned long bandIdleUs = 0;  // time of the band spent waiting, not encoding
+power_state_t powerState = POWER_ACTIVE; // only used by loop()
+unsigned long powerStateMs = 0;          // millis() when it was entered
+
+SPIClass sdSpi(HSPI);
+StreamBufferHandle_t archiveBuffer = NULL; // packets for archiveTask, NULL without a card
+printer_profile_t profile; // copy of the active printer's one taken for each job, only used by the print task
+
+SemaphoreHandle_t serialLock = NULL; // held for every write to Serial, a PC dump frame holds it throughout
 
 /**
- * Initial setup
+ * Serial text of every task, written under serialLock so it can't land inside a PC dump frame
  */
-void setup()
+class SerialLog : public Print
 {
-    Serial.begin(PC_BAUD_RATE);
+public:
+    size_t write(uint8_t c) override
+    {
+        return write(&c, 1);
+    }
 
-  SerialBT.begin("ESP32-GBCamPrint", true);    // master = true
-  SerialBT.setPin(pin);
-  SerialBT.connect(btaddress); //I recommend conecting with MAC adress, it's fast than using Name Search
-//  SerialBT.connect(btname);
+    size_t write(const uint8_t *data, size_t length) override
+    {
+        if (serialLock == NULL)
+        { // before setup()
+            return Serial.write(data, length);
+        }
+        xSemaphoreTake(serialLock, portMAX_DELAY);
+        size_t written = Serial.write(data, length);
+        xSemaphoreGive(serialLock);
+        return written;
+    }
+};
+
+SerialLog Log;
 
 
+/**
+ * Initial setup
+ */
+void setup()
+{
+    Serial.begin(SEND_TO_PC_AFTER_PRINTING ? PC_DUMP_BAUD_RATE : PC_BAUD_RATE);
+    serialLock = xSemaphoreCreateMutex();
 
 //    pinMode(PIN_DIP_SCALE, INPUT_PULLUP);
 //    pinMode(PIN_DIP_METHOD, INPUT_PULLUP);
@@ -175,26 +450,57 @@ void setup()
     pinMode(PIN_LED, OUTPUT);
     digitalWrite(PIN_LED, LOW);
 
+    // The link is armed first, packets wait in its ring until loop() runs
     gameboy_printer_setup();
-    delay(100);
+    for (byte i = 0; i < GBP_PORTS; i++)
+    {
+        ports[i] = {&(gbp_printers[i]), NULL, 0, 0, 0, 0};
+    }
+
+    profileLock = xSemaphoreCreateMutex();
+    for (byte i = 0; i < PRINTERS; i++)
+    {
+        printers[i].address = btaddress[i];
+        loadPrinterProfile(i);
+    }
+    profile = printers[activePrinter].profile;
 
 //    updateDipSwitches();
 //    delay(100);
 
-    epson_start();
-    delay(100);
-    epson_feed(1);
+    // Bluetooth starts in bluetoothTask, images wait in the print queue until the printer is connected
+    printWorkerSetup();
+    xTaskCreatePinnedToCore(bluetoothTask, "bluetoothTask", BT_TASK_STACK_SIZE, NULL, BT_TASK_PRIORITY, &bluetoothTaskHandle, 1 - xPortGetCoreID());
+#if SD_ARCHIVE
+    archiveSetup();
+#endif
 
 #if COPY_TEST_IMAGE_TO_BUFFER
     copyTestImageToBuffer();
 #endif
 
+    if (!digitalRead(PIN_BTN))
+    {
+        startCalibration();
+    }
+
 #if STARTUP_PRINTER_TEST
-    Serial.println("Sending test print");
+    Log.println("Sending test print");
     printerTest();
 #endif
 
-    Serial.println("Device loaded, waiting for print data...");
+#if DECODER_BENCHMARK
+    benchmarkDecoder();
+#endif
+
+#if PARSER_BENCHMARK
+    benchmarkParser();
+#endif
+
+    bootReadyMs = millis();
+    Log.print("Device loaded in ms: ");
+    Log.print(bootReadyMs);
+    Log.println(", waiting for print data...");
     digitalWrite(PIN_LED, HIGH);
 }
 
@@ -204,34 +510,57 @@ void setup()
 void loop()
 {
 //    updateDipSwitches();
-    bool schedulePrint = false;
 
-    // Packet received from gameboy
-    if (gbp_printer.packet_ready_flag)
+    // Packets received from each gameboy
+    for (byte i = 0; i < GBP_PORTS; i++)
+    {
+        updatePort(&ports[i]);
+    }
+
+    // If button pushed, print the last image again
+    updateButton();
+
+    // Settings from the PC
+    updateSerialCommands();
+
+    // Lower clock between prints
+    updatePower();
+}
+
+/**
+ * Handles what a link port received, the ISR keeps queueing while these are processed
+ */
+void updatePort(link_port_t *port)
+{
+    gbp_printer_t *printer = port->printer;
+    gbp_packet_slot_t *slot;
+    while ((slot = gbp_packet_ring_peek(&(printer->gbp_packet_ring))) != NULL)
     {
         digitalWrite(PIN_LED, LOW);
 
-        // Indicate To The Byte Scanner and the Message Parser to scan for new packet
-        gbp_rx_tx_byte_reset(&(gbp_printer.gbp_rx_tx_byte_buffer));
-        gbp_parse_message_reset(&(gbp_printer.gbp_packet_parser));
+        // Save it to SD before the packet is handled
+        archivePacket(port - ports, &(slot->packet));
 
         // Process this packet
-        switch (gbp_printer.gbp_packet.command)
+        switch (slot->packet.command)
         {
         case GBP_COMMAND_INIT:
         { // This clears the printer status register (and buffers etc... in the real printer)
-            gbp_printer.gbp_printer_status = {0};
-            clearBuffer();
+            printer->gbp_printer_status = {0};
+            abortReceive(port);
             break;
         }
         case GBP_COMMAND_DATA:
         { // This is called when new data is recieved.
-            recieveData();
+            unsigned long start = micros();
+            recieveData(port, &(slot->packet));
+            statsRecord(&stats.receive, micros() - start);
             break;
         }
         case GBP_COMMAND_PRINT:
         { // This would usually indicate to the GBP to start printing.
-            schedulePrint = true;
+            memcpy(printer->gbp_print_settings_buffer, slot->data, sizeof(printer->gbp_print_settings_buffer));
+            finishReceive(port);
             break;
         }
         case GBP_COMMAND_INQUIRY:
@@ -242,260 +571,1380 @@ void loop()
         }
 
         digitalWrite(PIN_LED, HIGH);
-        gbp_printer.packet_ready_flag = false; // Packet Processed
+        gbp_packet_ring_pop(&(printer->gbp_packet_ring)); // Packet Processed
+    }
+
+    // Report packets the ISR had no room for, they were NAKed so the Game Boy sends them again
+    if (printer->gbp_packet_ring.dropped != port->droppedPackets)
+    {
+        port->droppedPackets = printer->gbp_packet_ring.dropped;
+        Log.print("# ERROR: Packet ring overrun, NAKed: ");
+        Log.println(port->droppedPackets);
+    }
+
+    // Packets with a bad checksum never reach the ring, the status byte told the Game Boy to send them again
+    if (printer->gbp_link_stats.checksum_errors != port->checksumErrors)
+    {
+        port->checksumErrors = printer->gbp_link_stats.checksum_errors;
+        Log.print("# ERROR: Checksum error, packet NAKed after DATA packet ");
+        Log.println(port->dataPackets);
+    }
+
+    // Don't keep the print task waiting for an image that stopped arriving
+    print_job_t *job = port->receiveJob;
+    if (job && (job->state == JOB_QUEUED) && (millis() - port->lastDataTime > STREAM_TIMEOUT_MS))
+    {
+        Log.println("# ERROR: Stream timed out");
+        finishReceive(port);
     }
 
+    // Game Boy waits on the busy bit until everything was sent to the printer
+    updatePrinterBusy(port);
+
+    // Keep the link layer byte aligned
+    gameboy_printer_link_update(printer);
+
     // Trigger Timeout and reset the printer if byte stopped being recieved.
-    if ((gbp_printer.gbp_rx_tx_byte_buffer.syncronised))
+    if ((printer->gbp_rx_tx_byte_buffer.syncronised))
     {
-        if ((0 != gbp_printer.uptime_til_timeout_ms) && (millis() > gbp_printer.uptime_til_timeout_ms))
-        { // reset printer byte and packet processor
-            Serial.println("# ERROR: Timed Out");
-            gbp_rx_tx_byte_reset(&(gbp_printer.gbp_rx_tx_byte_buffer));
-            gbp_parse_message_reset(&(gbp_printer.gbp_packet_parser));
+        noInterrupts(); // 64 bits, the ISR may write it halfway through the read
+        int64_t timeout = printer->uptime_til_timeout_us;
+        interrupts();
+        if ((0 != timeout) && (esp_timer_get_time() > timeout))
+        { // reset printer byte and packet processor, the packet cut off was not committed to the ring
+            Log.println("# ERROR: Timed Out, packet thrown away");
+            printer->gbp_link_stats.timeouts++;
+            gbp_rx_tx_byte_reset(&(printer->gbp_rx_tx_byte_buffer));
+            gbp_parse_message_reset(&(printer->gbp_packet_parser));
         }
     }
     else
     { // During scanning phase timeout is not required.
-        gbp_printer.uptime_til_timeout_ms = 0;
+        noInterrupts();
+        printer->uptime_til_timeout_us = 0;
+        interrupts();
     }
+}
 
-    // If new data recieved or button pushed, start print
-    if (schedulePrint || !digitalRead(PIN_BTN))
+/**
+ * Tells if an image is being received on any port
+ */
+bool receiving()
+{
+    for (byte i = 0; i < GBP_PORTS; i++)
     {
-        bool w = false;
-        if (!digitalRead(PIN_BTN))
+        if (ports[i].receiveJob)
         {
-            w = true;
+            return true;
         }
-        print();
-        if (w)
+    }
+    return false;
+}
+
+/**
+ * Returns the printer with the fewest images waiting, the connected one on a tie
+ */
+byte leastBusyPrinter()
+{
+    byte best = activePrinter;
+    for (byte i = 0; i < PRINTERS; i++)
+    {
+        if (printers[i].queued - printers[i].printed < printers[best].queued - printers[best].printed)
         {
-            delay(2000);
+            best = i;
         }
     }
+    return best;
+}
+
+/**
+ * Hands a job to the print task, for "printer"
+ */
+void queueJob(print_job_t *job, byte printer)
+{
+    job->printer = printer;
+    printers[printer].queued++;
+    job->state = JOB_QUEUED;
+    xQueueSend(printQueue, &job, 0);
 }
 
 /**
- * Prints the data in the buffer
+ * Idle governor, lowers the clock once there was no link traffic and nothing to print for IDLE_AFTER_MS
+ * Full clock comes back at the end of the Game Boy's first packet: the link ISR keeps up at the idle
+ * clock, and switching between packets keeps the clock change out of the middle of a bit
  */
-void print()
+void updatePower()
 {
-//    epson_linespacing(24);
-    epson_linespacing(24);
-    if (totalBytes == 0)
+    static uint32_t lastCalls = 0;   // link ISR calls last seen
+    static uint32_t lastPackets = 0; // packets ended last seen, with the NAKed ones
+    static unsigned long lastActiveMs = 0;
+    static unsigned long wakeStartUs = 0; // first link traffic while idle, 0 if none
+
+    uint32_t calls = 0;
+    uint32_t packets = 0;
+    for (byte i = 0; i < GBP_PORTS; i++)
+    {
+        calls += gbp_printers[i].gbp_link_stats.isr_calls;
+        packets += gbp_printers[i].gbp_link_stats.packets + gbp_printers[i].gbp_link_stats.checksum_errors;
+    }
+    bool traffic = (calls != lastCalls);
+    bool packet = (packets != lastPackets);
+    bool work = printWorkPending();
+    lastCalls = calls;
+    lastPackets = packets;
+    unsigned long now = millis();
+    if (traffic || work)
+    {
+        lastActiveMs = now;
+    }
+
+    if (powerState == POWER_ACTIVE)
     {
+        if (now - lastActiveMs > IDLE_AFTER_MS)
+        {
+            setCpuFrequencyMhz(IDLE_CPU_MHZ);
+            setPowerState(POWER_IDLE);
+        }
         return;
     }
 
-    epson_center();
+    if (traffic && wakeStartUs == 0)
+    {
+        wakeStartUs = micros();
+    }
+    if (packet || work)
+    {
+        setCpuFrequencyMhz(ACTIVE_CPU_MHZ);
+        setPowerState(POWER_ACTIVE);
+        if (wakeStartUs)
+        {
+            statsRecord(&stats.wake, micros() - wakeStartUs);
+        }
+        wakeStartUs = 0;
+        return;
+    }
 
-    Serial.println("Data recieved, begin print!");
+#if IDLE_LIGHT_SLEEP
+    if (wakeStartUs == 0 && !btConnected && !btConnecting)
+    {
+        if (lightSleep())
+        {
+            wakeStartUs = micros();
+        }
+        return;
+    }
+#endif
+    delay(1); // the idle task halts the CPU meanwhile, the packet ring holds what arrives
+}
 
-//    if (method == GS_PRINT_METHOD)
-//    {
-//        if (scale < 3)
-//        {
-//            if (baudRate == FAST_BAUD_RATE)
-//            {
-//                printGsl();
-//            }
-//            else
-//            {
-//                printGsv0();
-//            }
-//        }
-//        else
-//        {
-//            gsXlPrint();
-//        }
-//    }
-//    else
-//    {
-//        if (scale == 2)
-//        {
-            printEscAsterisk2x();
-//        }
-//        else if (scale == 3)
-//        {
-//            printEscAsterisk3x();
-//        }
-//    }
+/**
+ * Tells if an image is being received, waits for the printer or is held for tiling
+ */
+bool printWorkPending()
+{
+    if (receiving() || uxQueueMessagesWaiting(printQueue) > 0)
+    {
+        return true;
+    }
+    for (byte i = 0; i < PRINT_QUEUE_LENGTH; i++)
+    {
+        if (printJobs[i].state == JOB_QUEUED || printJobs[i].state == JOB_HELD)
+        {
+            return true;
+        }
+    }
+    return false;
+}
 
-//    epson_feed(7);
-    epson_feed(2);
+/**
+ * Enters a power state, adding the time spent in the last one to the budget
+ */
+void setPowerState(power_state_t state)
+{
+    unsigned long now = millis();
+    stats.powerMs[powerState] += now - powerStateMs;
+    powerState = state;
+    powerStateMs = now;
+}
 
-//    if (cut)
-//    {
-//        if (method == ESC_PRINT_METHOD)
-//        {
-//            epson_feed(4);
-//        }
-//        epson_cut();
-//    }
+#if IDLE_LIGHT_SLEEP
+#if GBP_LINK_SPI_SLAVE
+#error "Light sleep wakes on the link clock interrupt, set GBP_LINK_SPI_SLAVE to 0"
+#endif
+#include <esp_sleep.h>
+#include <driver/gpio.h>
 
-    Serial.println("Print finished");
-    gbp_printer.uptime_til_pretend_print_finish_ms = 0;
-    gbp_printer.gbp_printer_status.printer_busy = false;
-    digitalWrite(PIN_LED, HIGH);
+/**
+ * Light sleeps until the link clock goes low or IDLE_SLEEP_MS pass
+ * The clock pins wake on their level meanwhile, their rising edge interrupt is put back after
+ * Returns true if the link woke it up
+ */
+bool lightSleep()
+{
+    static bool refused = false; // the Bluetooth stack may not allow it, it is not tried again
+    if (refused)
+    {
+        delay(1);
+        return false;
+    }
 
-#if SEND_TO_PC_AFTER_PRINTING
-    sendBufferToPc();
+    for (byte i = 0; i < GBP_PORTS; i++)
+    {
+        gpio_num_t sc = (gpio_num_t)gbp_printers[i].pins.sc;
+        gpio_intr_disable(sc);
+        gpio_wakeup_enable(sc, GPIO_INTR_LOW_LEVEL);
+    }
+    esp_sleep_enable_gpio_wakeup();
+    esp_sleep_enable_timer_wakeup(IDLE_SLEEP_MS * 1000ULL);
+
+    Serial.flush();
+    setPowerState(POWER_SLEEP);
+    esp_err_t result = esp_light_sleep_start();
+    setPowerState(POWER_IDLE);
+
+    for (byte i = 0; i < GBP_PORTS; i++)
+    {
+        gpio_num_t sc = (gpio_num_t)gbp_printers[i].pins.sc;
+        gpio_wakeup_disable(sc);
+        gpio_set_intr_type(sc, GPIO_INTR_POSEDGE);
+        gpio_intr_enable(sc);
+    }
+
+    if (result != ESP_OK)
+    {
+        Log.println("# ERROR: Light sleep refused, only the clock is lowered");
+        refused = true;
+        return false;
+    }
+    stats.lightSleeps++;
+    return esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO;
+}
 #endif
+
+/**
+ * Reprints the last image when the button is released, at the other scale if it was held
+ */
+void updateButton()
+{
+    static unsigned long pressedTime = 0;
+    static bool pressed = false;
+    if (!digitalRead(PIN_BTN))
+    {
+        if (!pressed)
+        {
+            pressed = true;
+            pressedTime = millis();
+        }
+        return;
+    }
+    if (!pressed)
+    {
+        return;
+    }
+
+    pressed = false;
+    unsigned long held = millis() - pressedTime;
+    if (held < BUTTON_DEBOUNCE_MS)
+    {
+        return;
+    }
+    if (held >= BUTTON_HOLD_MS)
+    {
+        scale = (scale == 2) ? 3 : 2;
+    }
+    reprint(1);
 }
 
 /**
- * Print by "ESC *" method
- * 3x scale
- * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=88
+ * Allocates the strip pool, creates the print queue and starts the print task
+ * The link ISR is attached on the core running setup() and loop(),
+ * so the Bluetooth output is pinned to the other one
  */
-void printEscAsterisk3x()
+void printWorkerSetup()
 {
-    epson_center();
+    byte *memory = NULL;
+    if (psramFound())
+    {
+        stripPoolSize = PSRAM_STRIP_POOL_SIZE;
+        memory = (byte *)ps_malloc(stripPoolSize * STRIP_BYTES);
+    }
+    if (memory == NULL)
+    {
+        stripPoolSize = STRIP_POOL_SIZE;
+        memory = (byte *)malloc(stripPoolSize * STRIP_BYTES);
+    }
 
-    int imgWidth = IMG_WIDTH * 3;
-    byte lineBuffer[IMG_WIDTH] = {};
+    stripPool = xQueueCreate(stripPoolSize, sizeof(byte *));
+    for (unsigned int i = 0; i < stripPoolSize; i++)
+    {
+        byte *strip = memory + i * STRIP_BYTES;
+        xQueueSend(stripPool, &strip, 0);
+    }
+    Log.print("Strips for ");
+    Log.print(stripPoolSize * STRIP_ROWS);
+    Log.println(" rows");
+    cacheSetup();
 
-    // line is 8 pixels high (by using 8 dot density is scaled internaly by the printer itself)
-    for (byte line = 0; line < IMG_HEIGHT / 8; line++)
+    for (byte i = 0; i < PRINT_QUEUE_LENGTH; i++)
     {
-        digitalWrite(PIN_LED, ((line % 2) == 0) ? HIGH : LOW);
-        byte lbi = 0;
-        // store in buffer for faster sending
-        for (byte column = 0; column < IMG_WIDTH; column++)
+        printJobs[i].strips = (byte **)calloc(stripPoolSize, sizeof(byte *));
+        printJobs[i].state = JOB_FREE;
+    }
+
+    printQueue = xQueueCreate(PRINT_QUEUE_LENGTH, sizeof(print_job_t *));
+    xTaskCreatePinnedToCore(printTask, "printTask", PRINT_TASK_STACK_SIZE, NULL, PRINT_TASK_PRIORITY, &printTaskHandle, 1 - xPortGetCoreID());
+}
+
+/**
+ * Takes a job for a new image
+ * A printed one is reused if none is free, the last image is kept as long as possible
+ */
+print_job_t *newJob()
+{
+    print_job_t *job = NULL;
+    for (byte i = 0; i < PRINT_QUEUE_LENGTH && job == NULL; i++)
+    {
+        if (printJobs[i].state == JOB_FREE)
         {
-            byte data = 0;
-            for (byte y = 0; y < 8; y++)
-            {
-                data = (data << 1) | bitRead(printBuffer[20 * y + line * 160 + column / 8], 7 - (column % 8));
-            }
-            lineBuffer[lbi++] = data;
+            job = &printJobs[i];
         }
-
-        // send data
-        epson_write(27);                   // ESC
-        epson_write(42);                   // *
-        epson_write(1);                    // 8-dot double density
-        epson_write(imgWidth & 0xFF);      // nL
-        epson_write(imgWidth >> 8 & 0xFF); // nH
-        for (lbi = 0; lbi < IMG_WIDTH; lbi++)
+    }
+    for (byte i = 0; i < PRINT_QUEUE_LENGTH && job == NULL; i++)
+    {
+        if (printJobs[i].state == JOB_PRINTED && &printJobs[i] != lastJob)
         {
-            // repeat column 3 times
-            for (byte s = 0; s < 3; s++)
-            {
-                epson_write(lineBuffer[lbi]);
-            }
+            job = &printJobs[i];
         }
-        epson_write(10); // LF
     }
+    if (job == NULL && lastJob && lastJob->state == JOB_PRINTED)
+    {
+        job = lastJob;
+    }
+    if (job == NULL)
+    {
+        return NULL;
+    }
+
+    freeJob(job);
+    job->rows = 0;
+    job->firstRow = 0;
+    job->complete = false;
+    job->calibrate = false;
+    job->palette = 0; // default palette until the PRINT packet
+    job->copies = copies;
+    job->port = 0;
+    job->hash = 0;
+    job->state = JOB_RECEIVING;
+    return job;
 }
 
 /**
- * Print by "ESC *" method
- * 2x scale
- * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=88
+ * Gives all the job's strips back to the pool
+ * Only for jobs not owned by the print task
  */
-void printEscAsterisk2x()
+void freeJob(print_job_t *job)
 {
-    epson_center();
+    job->complete = true;
+    releaseRows(job, job->rows);
+    job->state = JOB_FREE;
+    if (job == lastJob)
+    {
+        lastJob = NULL;
+    }
+}
 
-//    int imgWidth = IMG_WIDTH * 3;
-//    byte lineBuffer[IMG_WIDTH] = {};
+/**
+ * Gives strips with rows before "row" back to the pool
+ * The last partially filled strip is only released once the job is complete
+ */
+void releaseRows(print_job_t *job, unsigned int row)
+{
+    unsigned int end = row / STRIP_ROWS;
+    if (job->complete && row >= job->rows)
+    {
+        end = (job->rows + STRIP_ROWS - 1) / STRIP_ROWS;
+    }
+    for (unsigned int s = job->firstRow / STRIP_ROWS; s < end; s++)
+    {
+        byte **slot = &(job->strips[s % stripPoolSize]);
+        byte *strip = *slot;
+        if (strip)
+        { // clear the slot first, loop() may get the strip back straight away
+            *slot = NULL;
+            xQueueSend(stripPool, &strip, 0);
+        }
+    }
+    if (end * STRIP_ROWS > job->firstRow)
+    {
+        job->firstRow = end * STRIP_ROWS;
+    }
+}
 
+/**
+ * Called by the encoders once rows before "row" are sent
+ * Gives them back when the pool runs low, so long images keep streaming
+ */
+void recycleRows(print_job_t *job, unsigned int row)
+{
+    if (uxQueueMessagesWaiting(stripPool) < STRIP_LOW_WATER)
+    {
+        releaseRows(job, row);
+    }
+}
 
-    int imgWidth = IMG_WIDTH;
-    byte lineBuffer[IMG_WIDTH * 3] = {};
+/**
+ * Takes a free strip
+ * Images kept for a reprint are dropped if needed, a streamed job waits for the print task
+ */
+byte *takeStrip(print_job_t *job)
+{
+    byte *strip;
+    if (xQueueReceive(stripPool, &strip, 0) == pdTRUE)
+    {
+        return strip;
+    }
 
+    for (byte i = 0; i < PRINT_QUEUE_LENGTH; i++)
+    {
+        if (&printJobs[i] != job && printJobs[i].state == JOB_PRINTED)
+        {
+            freeJob(&printJobs[i]);
+        }
+    }
 
+    TickType_t wait = (job->state == JOB_QUEUED) ? pdMS_TO_TICKS(STRIP_WAIT_MS) : 0;
+    if (xQueueReceive(stripPool, &strip, wait) == pdTRUE)
+    {
+        return strip;
+    }
+    return NULL;
+}
 
-    // line is 12 pixels high
-    for (byte line = 0; line < IMG_HEIGHT / 12; line++)
+/**
+ * Adds rows to the job, taking strips from the pool as needed
+ * Returns false if the pool ran out, the rows that did not fit are dropped
+ */
+bool appendRows(print_job_t *job, const byte *src, unsigned int count)
+{
+    for (unsigned int r = 0; r < count; r++)
     {
-        digitalWrite(PIN_LED, ((line % 2) == 0) ? HIGH : LOW);
-        unsigned int lbi = 0;
-        for (byte column = 0; column < IMG_WIDTH; column++)
+        unsigned int row = job->rows;
+        byte **slot = &(job->strips[(row / STRIP_ROWS) % stripPoolSize]);
+        if (row % STRIP_ROWS == 0)
         {
-            uint32_t data = 0;
-            for (byte y = 0; y < 12; y++)
+            *slot = takeStrip(job);
+            if (*slot == NULL)
             {
-                byte a = bitRead(printBuffer[20 * y + line * 12 * EPSON_BYTES_PER_LINE + column / 8], 7 - (column % 8));
-                data = (((data << 1) | a) << 1) | a;
+                return false;
             }
-            lineBuffer[lbi++] = data >> 16 & 0xff;
-            lineBuffer[lbi++] = data >> 8 & 0xff;
-            lineBuffer[lbi++] = data & 0xff;
         }
-
-        // send data
-        epson_write(27);                   // ESC
-        epson_write(42);                   // *
-//        epson_write(32);                   // 24-dot single density
-        epson_write(32);                   // 24-dot double density
-        epson_write(imgWidth & 0xFF);      // nL
-        epson_write(imgWidth >> 8 & 0xFF); // nH
-        for (unsigned int i = 0; i < lbi; i++)
-        {
-            epson_write(lineBuffer[i]);
-        }
-        epson_write(10); // LF
-        epson_feed(2);
+        memcpy(*slot + (row % STRIP_ROWS) * ROW_BYTES, src + r * ROW_BYTES, ROW_BYTES);
+        job->hash = crc32_update(job->hash, src + r * ROW_BYTES, ROW_BYTES);
+        job->rows = row + 1;
     }
+    return true;
 }
 
 /**
- * Begins the print (scale: 1x, 2x)
- * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=99#gs_lparen_cl_fn112
+ * Returns a row of the job, it must not have been released yet
  */
-void printGsl()
-{
-    unsigned int payload = BUFFER_SIZE + 10; // pL and pH specify the number of bytes following m as (pL + pH × 256).
-    epson_write(29);                         // GS
-    epson_write(40);                         // (
-    epson_write(76);                         // L
-    epson_write(payload & 0xFF);             // pL
-    epson_write(payload >> 8 & 0xFF);        // pH
-    epson_write(48);                         // m
-    epson_write(112);                        // fn
-    epson_write(48);                         // a
-    epson_write(scale);                      // bx
-    epson_write(scale);                      // by
-    epson_write(49);                         // c
-    epson_write(IMG_WIDTH & 0xFF);           // xL
-    epson_write(IMG_WIDTH >> 8 & 0xFF);      // xH
-    epson_write(IMG_HEIGHT & 0xFF);          // yL
-    epson_write(IMG_HEIGHT >> 8 & 0xFF);     // yH
-
-    sendBuffer();
-    finishPrint();
+const byte *jobRow(print_job_t *job, unsigned int row)
+{
+    return job->strips[(row / STRIP_ROWS) % stripPoolSize] + (row % STRIP_ROWS) * ROW_BYTES;
 }
 
 /**
- * Begins the print - method for older printers (scale: 1x, 2x)
- * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=94
+ * Palette the job's rows are rasterized with, palette 0 is the default one
  */
-void printGsv0()
+byte jobPalette(print_job_t *job)
 {
-    epson_write(29);                          // GS
-    epson_write(118);                         // v
-    epson_write(48);                          // 0
-    epson_write(scale == 2 ? 51 : 48);        // m (scale)
-    epson_write((IMG_WIDTH / 8) & 0xFF);      // xL
-    epson_write((IMG_WIDTH / 8) >> 8 & 0xFF); // xH
-    epson_write(IMG_HEIGHT & 0xFF);           // yL
-    epson_write(IMG_HEIGHT >> 8 & 0xFF);      // yH
+    return job->palette ? job->palette : RASTER_DEFAULT_PALETTE;
+}
 
-    sendBuffer();
+/**
+ * Sets up the rasterizer for xScale dots per pixel, with the job's palette and the current settings
+ * Rows are stored as received, so a reprint can use another scale, threshold or method
+ */
+void beginRaster(print_job_t *job, byte xScale, byte plane)
+{
+    rasterBegin(&raster, xScale, job->palette, dither, threshold, plane);
 }
 
 /**
- * Sends the whole buffer to the printer
+ * Rasterizes rows of the job to a continuous buffer of dot rows, bands may span strips
+ * Every row is XSCALE dots per pixel and repeated YSCALE times, returns the number of dot rows written
  */
-void sendBuffer()
+template <byte XSCALE, byte YSCALE>
+unsigned int rasterRows(print_job_t *job, unsigned int firstRow, unsigned int count, byte *dst)
 {
-    for (int i = 0; i < BUFFER_SIZE; i++)
+    for (unsigned int r = 0; r < count; r++)
     {
-        digitalWrite(PIN_LED, ((i % 60) < 10) ? HIGH : LOW);
-        epson_write(printBuffer[i]);
+        const byte *row = jobRow(job, firstRow + r);
+        for (byte y = 0; y < YSCALE; y++)
+        {
+            dst += rasterRowScaled<XSCALE>(&raster, row, dst);
+        }
+    }
+    return count * YSCALE;
+}
+
+/**
+ * Marks the image being received as complete
+ * It is queued for printing, unless it is already printing while streamed
+ */
+void finishReceive(link_port_t *port)
+{
+    print_job_t *job = port->receiveJob;
+    if (job == NULL)
+    {
+        return;
+    }
+
+    job->palette = port->printer->gbp_print_settings_buffer[GBP_PRINT_BYTE_INDEX_PALETTE_VALUE];
+    job->complete = true;
+    if (job->state == JOB_RECEIVING)
+    {
+        queueJob(job, leastBusyPrinter());
+    }
+    else
+    {
+        xTaskNotifyGive(printTaskHandle);
+    }
+    lastJob = job;
+    port->receiveJob = NULL;
+}
+
+/**
+ * Drops the image being received, if it is already printing, it's finished with what arrived
+ */
+void abortReceive(link_port_t *port)
+{
+    if (port->receiveJob == NULL)
+    {
+        return;
+    }
+
+    if (port->receiveJob->state == JOB_RECEIVING)
+    {
+        freeJob(port->receiveJob);
+        port->receiveJob = NULL;
+    }
+    else
+    {
+        finishReceive(port);
+    }
+}
+
+/**
+ * Prints the last image "count" more times, if its strips were kept or its print with the current settings is cached
+ * It is rasterized again with the current settings unless cached, on the active printer
+ */
+bool reprint(byte count)
+{
+    static print_job_t cachedJob = {}; // stands for a job whose rows are gone, print() finds it in the cache
+    if (receiving() || lastJob == NULL)
+    {
+        return false;
+    }
+
+    print_job_t *job = lastJob;
+    if (job->state != JOB_PRINTED)
+    {
+        printer_profile_t saved = activeProfile(); // what the print task will print it with
+        if (job->state != JOB_FREE || cachedJob.state != JOB_FREE || cacheFind(cacheKey(job, chooseEncoder(&saved), &saved)) == NULL)
+        {
+            return false;
+        }
+        cachedJob.rows = job->rows;
+        cachedJob.firstRow = (job->rows + STRIP_ROWS - 1) / STRIP_ROWS * STRIP_ROWS; // no strips, nothing to encode or release
+        cachedJob.complete = true;
+        cachedJob.palette = job->palette;
+        cachedJob.hash = job->hash;
+        cachedJob.port = job->port;
+        job = &cachedJob;
+    }
+
+    job->copies = count;
+    queueJob(job, activePrinter);
+    return true;
+}
+
+/**
+ * Waits until "count" rows starting at "firstRow" were received, or the job is complete
+ * Returns the number of those rows available, 0 when the image ended before firstRow
+ */
+unsigned int waitForRows(print_job_t *job, unsigned int firstRow, unsigned int count)
+{
+    unsigned long start = micros();
+    while (!job->complete && job->rows < firstRow + count)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    }
+    bandIdleUs += micros() - start;
+
+    unsigned int rows = job->rows;
+    if (rows <= firstRow)
+    {
+        return 0;
+    }
+    rows -= firstRow;
+    return (rows < count) ? rows : count;
+}
+
+/**
+ * Print task, runs on the core not used by the link ISR
+ */
+void printTask(void *parameter)
+{
+    print_job_t *job;
+    for (;;)
+    {
+        if (xQueueReceive(printQueue, &job, pdMS_TO_TICKS(BT_KEEPALIVE_MS)) != pdTRUE)
+        {
+            keepPrinterAwake();
+        }
+        else
+        {
+            print_job_t *group[PRINT_TILES_MAX] = {job};
+            byte tileCount = gatherTiles(group);
+            usePrinter(job->printer);
+            byte count = job->calibrate ? 1 : job->copies;
+            for (byte copy = 0; copy < count && printable(job); copy++)
+            {
+                for (byte tries = 0; tries < BT_PRINT_TRIES; tries++)
+                {
+                    waitForConnection();
+                    printLost = false;
+                    if (job->calibrate)
+                    {
+                        calibrate(job);
+                    }
+                    else if (tileCount > 1)
+                    {
+                        printTiles(group, tileCount);
+                    }
+                    else
+                    {
+                        print(job);
+                    }
+                    waitForPrinter();
+                    if (!printLost || !printable(job))
+                    {
+                        break;
+                    }
+                    Log.println("# ERROR: Printer lost during the print, sending it again");
+                }
+            }
+            for (byte i = 0; i < tileCount; i++)
+            {
+                job = group[i];
+                printers[job->printer].printed++;
+                if (job->firstRow > 0 || job->calibrate)
+                { // already partly given back, it can't be reprinted
+                    releaseRows(job, job->rows);
+                    job->state = JOB_FREE;
+                }
+                else
+                {
+                    job->state = JOB_PRINTED;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Keeps the printer connected in the background, reconnecting with a growing delay
+ * Jobs wait in the print queue while there is no connection
+ */
+void bluetoothTask(void *parameter)
+{
+    // Started here, setup() does not wait for the stack to come up
+    SerialBT.begin("ESP32-GBCamPrint", true); // master = true
+    SerialBT.setPin(pin);
+    SerialBT.register_callback(bluetoothEvent);
+
+    unsigned long retry = BT_RETRY_MS;
+    for (;;)
+    {
+        byte printer = activePrinter;
+        if (SerialBT.connected())
+        {
+            if (btPrinter == printer)
+            {
+                btConnected = true;
+                retry = BT_RETRY_MS;
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BT_CHECK_MS));
+                continue;
+            }
+            btConnected = false;
+            SerialBT.disconnect(); // the print task moved on to another printer
+        }
+
+        btConnected = false;
+        Log.print("Connecting to printer ");
+        Log.print(printer);
+        Log.println("...");
+        btConnecting = true;
+        bool connected = connectPrinter(printer);
+        btConnecting = false;
+        if (connected)
+        {
+            btPrinter = printer;
+            btConnections++;
+            btConnected = true;
+            if (bootPrinterMs == 0)
+            {
+                bootPrinterMs = millis();
+            }
+            Log.println("Printer connected");
+            continue;
+        }
+
+        Log.print("# ERROR: Printer not connected, retry in ms: ");
+        Log.println(retry);
+        vTaskDelay(pdMS_TO_TICKS(retry));
+        retry = (retry * 2 < BT_RETRY_MAX_MS) ? retry * 2 : BT_RETRY_MAX_MS;
+    }
+}
+
+/**
+ * Connects to a printer, connecting by MAC address is faster than a name search
+ * The stack keeps the link key from the first pairing, and the SPP channel is saved
+ * for each printer, so later connects skip the service search too
+ */
+bool connectPrinter(byte printer)
+{
+    uint8_t *address = (uint8_t *)printers[printer].address;
+#if BT_CACHE_CHANNEL
+    char key[13];
+    printerKey(printer, key);
+    Preferences channels; // "preferences" is under profileLock
+    channels.begin("channels", false);
+    byte channel = channels.getUChar(key, 0);
+    if (channel && SerialBT.connect(address, channel))
+    {
+        channels.end();
+        return true;
+    }
+    if (channel)
+    {
+        Log.println("# ERROR: Saved SPP channel failed, searching the printer's services");
+        channels.remove(key);
+    }
+
+    btChannel = 0;
+    bool connected = SerialBT.connect(address);
+    if (connected && btChannel)
+    {
+        channels.putUChar(key, btChannel);
+    }
+    channels.end();
+    return connected;
+#else
+    return SerialBT.connect(address);
+#endif
+}
+
+/**
+ * SPP events, a closed link wakes bluetoothTask to reconnect straight away
+ */
+void bluetoothEvent(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
+{
+    if (event == ESP_SPP_CLOSE_EVT)
+    {
+        btConnected = false;
+        xTaskNotifyGive(bluetoothTaskHandle);
+    }
+    else if (event == ESP_SPP_DISCOVERY_COMP_EVT && param->disc_comp.status == ESP_SPP_SUCCESS && param->disc_comp.scn_num > 0)
+    { // service search of connect(), bluetoothTask saves the channel
+        btChannel = param->disc_comp.scn[0];
+    }
+}
+
+/**
+ * Waits for the printer, a new connection resets it first
+ */
+void waitForConnection()
+{
+    static unsigned int connection = 0;
+    while (!btConnected || btPrinter != activePrinter)
+    {
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    if (connection != btConnections)
+    {
+        connection = btConnections;
+        epson_start();
+        epson_feed(1);
+        epson_flush();
+    }
+}
+
+/**
+ * Makes "printer" the active one, bluetoothTask switches the link to it
+ * Only called by the print task, between jobs: the job is printed with the profile as it is now,
+ * profile commands typed during the print apply to the next one
+ */
+void usePrinter(byte printer)
+{
+    xSemaphoreTake(profileLock, portMAX_DELAY);
+    profile = printers[printer].profile;
+    xSemaphoreGive(profileLock);
+    if (printer == activePrinter)
+    {
+        return;
+    }
+    activePrinter = printer;
+    xTaskNotifyGive(bluetoothTaskHandle);
+}
+
+/**
+ * Asks an idle printer for its status, so it doesn't close the link
+ */
+void keepPrinterAwake()
+{
+    if (btConnected)
+    {
+        epson_write(0x10); // DLE
+        epson_write(0x04); // EOT
+        epson_write(1);    // n, printer status
+        epson_flush();
+    }
+}
+
+/**
+ * Mounts the card and starts the archive task, on the print task's core
+ */
+void archiveSetup()
+{
+    sdSpi.begin(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+    if (!SD.begin(SD_CS_PIN, sdSpi, SD_FREQUENCY))
+    {
+        Log.println("# ERROR: No SD card, images are not archived");
+        return;
+    }
+    SD.mkdir("/gbpxl");
+    archiveBuffer = xStreamBufferCreate(ARCHIVE_BUFFER_SIZE, 1);
+    xTaskCreatePinnedToCore(archiveTask, "archiveTask", ARCHIVE_TASK_STACK_SIZE, NULL, ARCHIVE_TASK_PRIORITY, NULL, 1 - xPortGetCoreID());
+}
+
+/**
+ * Hands a packet from link port "port" to the archive task, never waits: if there is no room it is dropped
+ * Records are the port, the command, the payload length (2 bytes, LSB first) and the payload
+ */
+void archivePacket(byte port, const gbp_packet_t *packet)
+{
+    if (archiveBuffer == NULL || packet->command == GBP_COMMAND_INQUIRY)
+    {
+        return;
+    }
+
+    unsigned int length = packet->data_ptr ? packet->data_length : 0;
+    byte header[4] = {port, packet->command, (byte)(length & 0xFF), (byte)(length >> 8)};
+    if (xStreamBufferSpacesAvailable(archiveBuffer) < sizeof(header) + length)
+    {
+        stats.archiveDropped++;
+        return;
+    }
+    xStreamBufferSend(archiveBuffer, header, sizeof(header), 0);
+    xStreamBufferSend(archiveBuffer, packet->data_ptr, length, 0);
+}
+
+/**
+ * Reads exactly "length" bytes of the records from loop()
+ */
+void archiveRead(byte *dst, unsigned int length)
+{
+    while (length > 0)
+    {
+        size_t count = xStreamBufferReceive(archiveBuffer, dst, length, portMAX_DELAY);
+        dst += count;
+        length -= count;
+    }
+}
+
+/**
+ * png_write_t for an archive_file_t, whole blocks go to the card
+ */
+void archiveWrite(void *context, const byte *data, unsigned int length)
+{
+    archive_file_t *file = (archive_file_t *)context;
+    while (length > 0)
+    {
+        unsigned int chunk = ARCHIVE_BLOCK_SIZE - file->length;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        memcpy(file->block + file->length, data, chunk);
+        file->length += chunk;
+        data += chunk;
+        length -= chunk;
+        if (file->length == ARCHIVE_BLOCK_SIZE)
+        {
+            file->file.write(file->block, ARCHIVE_BLOCK_SIZE);
+            file->length = 0;
+        }
+    }
+}
+
+/**
+ * Writes what is left in the block buffer
+ */
+void archiveFlush(archive_file_t *file)
+{
+    if (file->length > 0)
+    {
+        file->file.write(file->block, file->length);
+        file->length = 0;
+    }
+}
+
+/**
+ * Writes the images received to SD, each one as:
+ * - NNNNN.bin, its packets as a Game Boy would send them (uncompressed, without the printer's replies)
+ * - NNNNN.png, 2 bit gray with the default palette, a strip for each DATA packet
+ * An image starts with the first packet after the last PRINT, and ends with the next PRINT (or INIT)
+ * Each link port has its own image, numbered when its first packet comes
+ */
+void archiveTask(void *parameter)
+{
+    static byte data[GBP_PACKET_BUFFER_SIZE];
+    static archive_image_t images[GBP_PORTS];
+    byte rows[STRIP_BYTES];
+    for (byte i = 0; i < GBP_PORTS; i++)
+    {
+        images[i].raw.block = (byte *)malloc(ARCHIVE_BLOCK_SIZE);
+        images[i].image.block = (byte *)malloc(ARCHIVE_BLOCK_SIZE);
+    }
+
+    Preferences archivePreferences; // "preferences" is under profileLock
+    archivePreferences.begin("archive", false);
+    unsigned int number = archivePreferences.getUInt("next", 0);
+
+    for (;;)
+    {
+        byte header[4];
+        archiveRead(header, sizeof(header));
+        byte command = header[1];
+        unsigned int length = header[2] | (header[3] << 8);
+        archiveRead(data, length);
+        archive_image_t *archive = &images[header[0]];
+
+        if (archive->open && command == GBP_COMMAND_INIT && archive->png.height > 0)
+        { // the last image never got its PRINT
+            archiveFinish(archive);
+        }
+        if (!archive->open)
+        {
+            char path[20];
+            sprintf(path, "/gbpxl/%05u.bin", number);
+            archive->raw.file = SD.open(path, FILE_WRITE);
+            sprintf(path, "/gbpxl/%05u.png", number);
+            archive->image.file = SD.open(path, FILE_WRITE);
+            if (!archive->raw.file || !archive->image.file)
+            {
+                Log.println("# ERROR: Can't create archive files");
+                archive->raw.file.close();
+                archive->image.file.close();
+                continue;
+            }
+            pngBegin(&archive->png, IMG_WIDTH, 2, archiveWrite, &archive->image);
+            archive->open = true;
+            number++;
+            archivePreferences.putUInt("next", number);
+        }
+
+        // Packet, with the sync word and checksum
+        byte packet[6] = {0x88, 0x33, command, 0, header[2], header[3]};
+        uint16_t checksum = command + header[2] + header[3];
+        for (unsigned int i = 0; i < length; i++)
+        {
+            checksum += data[i];
+        }
+        byte footer[2] = {(byte)(checksum & 0xFF), (byte)(checksum >> 8)};
+        archiveWrite(&archive->raw, packet, sizeof(packet));
+        archiveWrite(&archive->raw, data, length);
+        archiveWrite(&archive->raw, footer, sizeof(footer));
+
+        if (command == GBP_COMMAND_DATA && length > 0)
+        {
+            gbp_packet_t tiles = {0};
+            tiles.data_ptr = data;
+            tiles.data_length = length;
+            unsigned int bytes = decodeTiles(&tiles, rows);
+            for (unsigned int i = 0; i < bytes; i++)
+            { // color 3 is black, PNG gray 0 is
+                rows[i] = ~rows[i];
+            }
+            pngRows(&archive->png, rows, bytes / ROW_BYTES, ROW_BYTES);
+        }
+        else if (command == GBP_COMMAND_PRINT)
+        {
+            archiveFinish(archive);
+        }
+    }
+}
+
+/**
+ * Ends the image's PNG, writes its real height and closes both files
+ */
+void archiveFinish(archive_image_t *archive)
+{
+    byte header[PNG_HEADER_LENGTH];
+    pngEnd(&archive->png);
+    archiveFlush(&archive->image);
+    pngHeader(&archive->png, header);
+    archive->image.file.seek(PNG_HEADER_OFFSET);
+    archive->image.file.write(header, sizeof(header));
+    archive->image.file.close();
+    archiveFlush(&archive->raw);
+    archive->raw.file.close();
+    archive->open = false;
+    stats.archived++;
+}
+
+/**
+ * Waits until the printer has taken everything sent so far
+ */
+void waitForPrinter()
+{
+    SerialBT.flush(); // returns once the SPP stack has sent the staged bytes
+
+#if PRINTER_STATUS_QUERY
+    unsigned long start = millis();
+    while (millis() - start < PRINTER_OFFLINE_WAIT_MS)
+    {
+        int status = epson_status(1);
+        if (status < 0 || !(status & 0x08))
+        { // no answer, or online again
+            break;
+        }
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+#endif
+}
+
+/**
+ * Clears the Game Boy's busy bit once no job from its port is waiting or printing
+ */
+void updatePrinterBusy(link_port_t *port)
+{
+    byte index = port - ports;
+    for (byte i = 0; i < PRINT_QUEUE_LENGTH; i++)
+    {
+        if (printJobs[i].state == JOB_QUEUED && printJobs[i].port == index)
+        { // queued jobs stay QUEUED until the print task is done with them
+            return;
+        }
+    }
+
+    // A PRINT the ISR already answered busy to may still be in the ring or on the wire
+    gbp_printer_t *printer = port->printer;
+    noInterrupts();
+    if (!printer->gbp_rx_tx_byte_buffer.syncronised && gbp_packet_ring_peek(&(printer->gbp_packet_ring)) == NULL)
+    {
+        printer->gbp_printer_status.printer_busy = false;
+        printer->gbp_printer_status.print_buffer_full = false;
+    }
+    interrupts();
+}
+
+/**
+ * Prints the job, rows are printed as soon as they arrive when streaming
+ */
+void print(print_job_t *job)
+{
+    encoder = chooseEncoder(&profile);
+    byte palette = jobPalette(job); // while streaming the previous PRINT's, the key is only known once the job is complete
+    unsigned long start = micros();
+    unsigned long bytes = epsonTxBytes;
+    if (job->complete && cachePrint(cacheKey(job, encoder, &profile)))
+    {
+        Log.println("Sent from the cache");
+    }
+    else
+    {
+        if (job->firstRow > 0)
+        {
+            Log.println("# ERROR: The image is no longer kept");
+            return;
+        }
+        cacheBegin(job->complete ? cacheKey(job, encoder, &profile) : 0);
+//        epson_linespacing(24);
+        epson_linespacing(profile.lineSpacing);
+        if (waitForRows(job, 0, 1) == 0)
+        {
+            cacheEnd(0);
+            return;
+        }
+
+        epson_center();
+
+        Log.println("Data recieved, begin print!");
+
+        start = micros();
+        bytes = epsonTxBytes;
+        bandStartUs = start;
+        bandIdleUs = 0;
+        Log.print("Encoder: ");
+        Log.print(encoder->name);
+        Log.print(" ");
+        Log.print(encoder->scale);
+        Log.println("x");
+        encoder->print(job);
+
+//        epson_feed(7);
+        epson_feed(2);
+        epson_flush();
+        // all rows are in now, a palette that came with the PRINT packet after the start was not used throughout
+        cacheEnd((job->complete && jobPalette(job) == palette) ? cacheKey(job, encoder, &profile) : 0);
+    }
+
+    unsigned long time = micros() - start;
+    statsRecord(&stats.job, time);
+    stats.jobs++;
+    stats.lastJobBytes = epsonTxBytes - bytes;
+    stats.lastJobBytesPerSecond = (uint64_t)stats.lastJobBytes * 1000000 / (time ? time : 1);
+
+//    if (cut)
+//    {
+//        if (method == ESC_PRINT_METHOD)
+//        {
+//            epson_feed(4);
+//        }
+//        epson_cut();
+//    }
+
+    Log.println("Print finished");
+    digitalWrite(PIN_LED, HIGH);
+
+#if SEND_TO_PC_AFTER_PRINTING
+    sendBufferToPc(job);
+#endif
+}
+
+/**
+ * Print by "ESC *" method
+ * Bands are BAND_DOTS dots high, each pixel XSCALE columns wide and YSCALE dot rows high,
+ * "mode" scales them up further in the printer:
+ * 2x: printEscAsterisk<1, 2, 24, 32>, 12 pixel rows doubled to 24-dot single density
+ * 3x: printEscAsterisk<3, 1, 8, 1>, 8 pixel rows of 8-dot double density (scaled internaly by the printer itself)
+ * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=88
+ */
+template <byte XSCALE, byte YSCALE, byte BAND_DOTS, byte MODE>
+void printEscAsterisk(print_job_t *job)
+{
+    const unsigned int imgWidth = IMG_WIDTH * XSCALE;
+    const unsigned int stride = EPSON_BYTES_PER_LINE * XSCALE; // bytes of a dot row
+    const byte groups = BAND_DOTS / 8;                          // bytes of a column
+    const byte bandRows = BAND_DOTS / YSCALE;
+    byte lineBuffer[IMG_WIDTH * XSCALE * groups] = {};
+
+    epson_center();
+    beginRaster(job, XSCALE, RASTER_MONO);
+
+    unsigned int rows;
+    for (unsigned int line = 0; (rows = waitForRows(job, line * bandRows, bandRows)) > 0; line++)
+    {
+        digitalWrite(PIN_LED, ((line % 2) == 0) ? HIGH : LOW);
+
+        // store in buffer for faster sending
+        byte band[BAND_DOTS * stride];
+        unsigned int dots = rasterRows<XSCALE, YSCALE>(job, line * bandRows, rows, band);
+
+        unsigned int lbi = 0;
+        for (unsigned int x = 0; x < stride; x++)
+        {
+            byte columns[groups][8]; // dots 0-7, 8-15 and 16-23 of each column
+            for (byte g = 0; g < groups; g++)
+            {
+                byte count = (dots > g * 8) ? dots - g * 8 : 0;
+                transpose8(band + x + g * 8 * stride, stride, (count < 8) ? count : 8, columns[g]);
+            }
+            for (byte c = 0; c < 8; c++)
+            {
+                for (byte g = 0; g < groups; g++)
+                {
+                    lineBuffer[lbi++] = columns[g][c];
+                }
+            }
+        }
+
+        // send data, blank columns are cut off and blank bands fed instead
+        unsigned int cut = blankColumns(lineBuffer, imgWidth, groups);
+        if (cut < imgWidth)
+        {
+            unsigned int width = imgWidth - 2 * cut;
+            epson_write(27);                // ESC
+            epson_write(42);                // *
+            epson_write(MODE);              // m
+            epson_write(width & 0xFF);      // nL
+            epson_write(width >> 8 & 0xFF); // nH
+            epson_write(lineBuffer + cut * groups, width * groups);
+            epson_write(10); // LF
+        }
+        else
+        {
+            epson_feed_dots(profile.lineSpacing);
+        }
+        if (profile.bandFeed)
+        {
+            epson_feed(profile.bandFeed);
+        }
+        finishBand(job, line * bandRows + rows);
+    }
+}
+
+/**
+ * Transposes an 8x8 bit block, used to turn raster rows into "ESC *" columns
+ * src: first of the rows (MSB is the leftmost pixel), stride bytes apart,
+ *      only the first "rows" rows are read, the rest is taken as white
+ * columns: 8 bytes, one for each pixel column (MSB is the top row)
+ * https://www.hackersdelight.org/ (transpose8rS64)
+ */
+void transpose8(const byte *src, unsigned int stride, byte rows, byte *columns)
+{
+    uint64_t x = 0;
+    for (byte y = 0; y < rows; y++)
+    {
+        x |= (uint64_t)src[y * stride] << (56 - 8 * y);
+    }
+
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+
+    for (byte c = 0; c < 8; c++)
+    {
+        columns[c] = x >> (56 - 8 * c);
+    }
+}
+
+/**
+ * Begins the print (scale: 1x, 2x)
+ * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=99#gs_lparen_cl_fn112
+ */
+void printGsl(print_job_t *job)
+{
+    // the height is in the header, so images are sent a frame (IMG_HEIGHT rows, less if the payload is limited) at a time
+    unsigned int frame = profileBandRows(&profile, EPSON_BYTES_PER_LINE, IMG_HEIGHT);
+    unsigned int height;
+    for (unsigned int base = 0; (height = waitForRows(job, base, frame)) > 0; base += frame)
+    {
+        printGslFrame(job, base, height);
+    }
+}
+
+/**
+ * Stores and prints "height" rows of the job starting at "base" by "GS ( L"
+ * Multiple tone printers get the 4 bit planes of a 16 level gray image, one "c" each
+ */
+void printGslFrame(print_job_t *job, unsigned int base, unsigned int height)
+{
+    bool multiTone = profile.flags & PROFILE_MULTI_TONE;
+    beginRaster(job, 1, multiTone ? 0 : RASTER_MONO);
+    unsigned int top, bottom;
+    unsigned int cut = trimRows(job, base, height, &top, &bottom) / 8; // bytes cut from both sides
+    unsigned int width = EPSON_BYTES_PER_LINE - 2 * cut;
+    epson_feed_dots(top * encoder->scale);
+    if (top == height)
+    {
+        finishBand(job, base + height);
+        return;
+    }
+
+    byte planes = multiTone ? 4 : 1;
+    for (byte plane = 0; plane < planes; plane++)
+    {
+        beginRaster(job, 1, multiTone ? plane : RASTER_MONO);
+        rasterSkip(&raster, top);
+
+        unsigned int rows = height - top - bottom;
+        unsigned int payload = rows * width + 10; // pL and pH specify the number of bytes following m as (pL + pH × 256).
+        epson_write(29);                         // GS
+        epson_write(40);                         // (
+        epson_write(76);                         // L
+        epson_write(payload & 0xFF);             // pL
+        epson_write(payload >> 8 & 0xFF);        // pH
+        epson_write(48);                         // m
+        epson_write(112);                        // fn
+        epson_write(multiTone ? 52 : 48);        // a (tone)
+        epson_write(encoder->scale);             // bx
+        epson_write(encoder->scale);             // by
+        epson_write(49 + plane);                 // c
+        epson_write((width * 8) & 0xFF);         // xL
+        epson_write((width * 8) >> 8 & 0xFF);    // xH
+        epson_write(rows & 0xFF);                // yL
+        epson_write(rows >> 8 & 0xFF);           // yH
+
+        sendRows(job, base + top, rows, cut);
+    }
+    finishPrint();
+    epson_feed_dots(bottom * encoder->scale);
+    finishBand(job, base + height);
+}
+
+/**
+ * Begins the print - method for older printers (scale: 1x, 2x)
+ * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=94
+ */
+void printGsv0(print_job_t *job)
+{
+    // the height is in the header, so images are sent a frame (IMG_HEIGHT rows, less if the payload is limited) at a time
+    unsigned int frame = profileBandRows(&profile, EPSON_BYTES_PER_LINE, IMG_HEIGHT);
+    unsigned int height;
+    for (unsigned int base = 0; (height = waitForRows(job, base, frame)) > 0; base += frame)
+    {
+        printGsv0Frame(job, base, height);
+    }
+}
+
+/**
+ * Prints "height" rows of the job starting at "base" by "GS v 0"
+ */
+void printGsv0Frame(print_job_t *job, unsigned int base, unsigned int height)
+{
+    beginRaster(job, 1, RASTER_MONO);
+    unsigned int top, bottom;
+    unsigned int cut = trimRows(job, base, height, &top, &bottom) / 8; // bytes cut from both sides
+    unsigned int width = EPSON_BYTES_PER_LINE - 2 * cut;
+    unsigned int rows = height - top - bottom;
+    epson_feed_dots(top * encoder->scale);
+    if (top < height)
+    {
+        epson_write(29);                            // GS
+        epson_write(118);                           // v
+        epson_write(48);                            // 0
+        epson_write(encoder->scale == 2 ? 51 : 48); // m (scale)
+        epson_write(width & 0xFF);                  // xL
+        epson_write(width >> 8 & 0xFF);             // xH
+        epson_write(rows & 0xFF);                   // yL
+        epson_write(rows >> 8 & 0xFF);              // yH
+
+        rasterSkip(&raster, top);
+        sendRows(job, base + top, rows, cut);
+        epson_feed_dots(bottom * encoder->scale);
+    }
+    finishBand(job, base + height);
+}
+
+/**
+ * Rasterizes rows of the job unscaled and sends them to the printer, without "cut" bytes on both sides
+ */
+void sendRows(print_job_t *job, unsigned int firstRow, unsigned int count, unsigned int cut)
+{
+    byte line[EPSON_BYTES_PER_LINE];
+    for (unsigned int r = 0; r < count; r++)
+    {
+        digitalWrite(PIN_LED, ((r % 3) == 0) ? HIGH : LOW);
+        rasterRowScaled<1>(&raster, jobRow(job, firstRow + r), line);
+        epson_write(line + cut, EPSON_BYTES_PER_LINE - 2 * cut);
     }
 }
 
@@ -503,145 +1952,1246 @@ void sendBuffer()
  * Sends a command to print all data in printer's buffer
  *https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=98
  */
-void finishPrint()
+void finishPrint()
+{
+    epson_write(29); // GS
+    epson_write(40); // (
+    epson_write(76); // L
+    epson_write(2);  // pL
+    epson_write(0);  // pH
+    epson_write(48); // m
+    epson_write(50); // fn
+    epson_flush();
+}
+
+/*
+ * Provides 2x, 3x or 4x scaled print, by GS ( L or GS v 0 (COMMAND)
+ * since TM-T88 doesn't have big enough buffer for 3x scaled image, it must be sent in batches
+ * 4x is 640 dots wide, it needs a head of at least that many dots
+ */
+template <byte SCALE, byte COMMAND>
+void gsXlPrint(print_job_t *job)
+{
+    Log.println("Begin xl print");
+    const byte scale = SCALE;
+    const bool gsl = (COMMAND == PROFILE_GS_L);
+    beginRaster(job, scale, RASTER_MONO);
+    unsigned int band = profileBandRows(&profile, EPSON_BYTES_PER_LINE * scale * scale, IMG_HEIGHT);
+    unsigned int lines;
+    for (unsigned int base = 0; (lines = waitForRows(job, base, band)) > 0; base += band)
+    {
+        unsigned int top, bottom;
+        unsigned int cut = trimRows(job, base, lines, &top, &bottom) * scale / 8; // bytes cut from both sides
+        unsigned int width = EPSON_BYTES_PER_LINE * scale - 2 * cut;
+        epson_feed_dots(top * scale);
+        rasterSkip(&raster, top * scale);
+        if (top == lines)
+        {
+            finishBand(job, base + lines);
+            continue;
+        }
+
+        if (gsl)
+        {
+            gsXlPrintBeginGsl((lines - top - bottom) * scale, width);
+        }
+        else
+        {
+            gsXlPrintBeginGsv0((lines - top - bottom) * scale, width);
+        }
+        for (unsigned int line = base + top; line < base + lines - bottom; line++)
+        {
+            byte lineBuffer[EPSON_BYTES_PER_LINE * SCALE];
+            for (byte y = 0; y < scale; y++) // each line is "scale" dot rows, dithered separately
+            {
+                rasterRowScaled<SCALE>(&raster, jobRow(job, line), lineBuffer);
+                epson_write(lineBuffer + cut, width);
+            }
+            digitalWrite(PIN_LED, ((line % 2) == 0) ? HIGH : LOW);
+        }
+        if (gsl)
+        {
+            finishPrint();
+        }
+        epson_feed_dots(bottom * scale);
+        rasterSkip(&raster, bottom * scale);
+        finishBand(job, base + lines);
+    }
+}
+
+/**
+ * Starts scaled print batch, "h" dot rows of "bytes"
+ */
+void gsXlPrintBeginGsl(unsigned int h, unsigned int bytes)
+{
+    unsigned int w = bytes * 8;
+    unsigned int payload = w / 8 * h + 10;
+    epson_write(29);                  // GS
+    epson_write(40);                  // (
+    epson_write(76);                  // L
+    epson_write(payload & 0xFF);      // pL
+    epson_write(payload >> 8 & 0xFF); // pH
+    epson_write(48);                  // m
+    epson_write(112);                 // fn
+    epson_write(48);                  // a
+    epson_write(1);                   // bx
+    epson_write(1);                   // by
+    epson_write(49);                  // c
+    epson_write(w & 0xFF);            // xL
+    epson_write(w >> 8 & 0xFF);       // xH
+    epson_write(h & 0xFF);            // yL
+    epson_write(h >> 8 & 0xFF);       // yH
+}
+
+/**
+ * Starts scaled print batch, "h" dot rows of "bytes"
+ * method for older printers
+ */
+void gsXlPrintBeginGsv0(unsigned int h, unsigned int bytes)
+{
+    unsigned int w = bytes * 8;
+    epson_write(29);                  // GS
+    epson_write(118);                 // v
+    epson_write(48);                  // 0
+    epson_write(48);                  // m (scale)
+    epson_write((w / 8) & 0xFF);      // xL
+    epson_write((w / 8) >> 8 & 0xFF); // xH
+    epson_write(h & 0xFF);            // yL
+    epson_write(h >> 8 & 0xFF);       // yH
+}
+
+/**
+ * Prints up to PRINT_TILES_MAX complete images side by side, at the largest scale that fits the head
+ * Rasterized here, so any scale works with GS ( L and GS v 0, and with ESC * for the printers that only take that
+ */
+void printTiles(print_job_t **group, byte count)
+{
+    byte s = tileScale(count);
+    byte allowed = profile.command ? profile.command : profile.commands;
+    byte command = (allowed & PROFILE_GS_L) ? PROFILE_GS_L : (allowed & PROFILE_GS_V0) ? PROFILE_GS_V0 : PROFILE_ESC_ASTERISK;
+    bool asterisk = (command == PROFILE_ESC_ASTERISK);
+    byte xScale = (asterisk && (s % 2) == 0) ? s / 2 : s; // ESC * single density doubles the dots
+    unsigned int bytes = count * EPSON_BYTES_PER_LINE * xScale; // per dot row
+    unsigned int height = 0;
+    for (byte i = 0; i < count; i++)
+    {
+        if (group[i]->rows > height)
+        {
+            height = group[i]->rows;
+        }
+    }
+
+    // one raster for each tile, they have their own palette and dithering state
+    raster_t *rasters = (raster_t *)malloc(count * sizeof(raster_t));
+    byte *band = (byte *)malloc(asterisk ? 2 * 24 * bytes : bytes);
+    if (rasters == NULL || band == NULL)
+    {
+        Log.println("# ERROR: No memory for tiles, printing them one by one");
+        free(rasters);
+        free(band);
+        for (byte i = 0; i < count; i++)
+        {
+            print(group[i]);
+        }
+        return;
+    }
+    for (byte i = 0; i < count; i++)
+    {
+        rasterBegin(&rasters[i], xScale, group[i]->palette, dither, threshold, RASTER_MONO);
+    }
+
+    Log.print("Tiles: ");
+    Log.print(count);
+    Log.print(" at ");
+    Log.print(s);
+    Log.println("x");
+    unsigned long start = micros();
+    unsigned long sent = epsonTxBytes;
+    epson_linespacing(profile.lineSpacing);
+    epson_center();
+    bandStartUs = start;
+    bandIdleUs = 0;
+
+    // ESC * bands are 24 dots high, every scale divides them, raster bands are up to 255 dot rows
+    unsigned int lines = asterisk ? 24 / s : profileBandRows(&profile, bytes * s, 255 / s);
+    for (unsigned int base = 0; base < height; base += lines)
+    {
+        unsigned int rows = min(lines, height - base);
+        digitalWrite(PIN_LED, ((base / lines) % 2 == 0) ? HIGH : LOW);
+        if (asterisk)
+        {
+            memset(band, 0, 24 * bytes);
+            for (unsigned int r = 0; r < rows * s; r++)
+            {
+                rasterTiles(group, count, rasters, base + r / s, band + r * bytes);
+            }
+            byte *columns = band + 24 * bytes;
+            for (unsigned int x = 0; x < bytes; x++)
+            {
+                byte dots[3][8]; // dots 0-7, 8-15 and 16-23 of each column
+                for (byte g = 0; g < 3; g++)
+                {
+                    transpose8(band + x + g * 8 * bytes, bytes, 8, dots[g]);
+                }
+                for (byte c = 0; c < 8; c++)
+                {
+                    for (byte g = 0; g < 3; g++)
+                    {
+                        *columns++ = dots[g][c];
+                    }
+                }
+            }
+
+            unsigned int width = bytes * 8;
+            unsigned int cut = blankColumns(band + 24 * bytes, width, 3);
+            if (cut < width)
+            {
+                width -= 2 * cut;
+                epson_write(27);                // ESC
+                epson_write(42);                // *
+                epson_write((xScale == s) ? 33 : 32); // 24-dot double or single density
+                epson_write(width & 0xFF);      // nL
+                epson_write(width >> 8 & 0xFF); // nH
+                epson_write(band + 24 * bytes + cut * 3, width * 3);
+                epson_write(10); // LF
+            }
+            else
+            {
+                epson_feed_dots(profile.lineSpacing);
+            }
+            if (profile.bandFeed)
+            {
+                epson_feed(profile.bandFeed);
+            }
+        }
+        else
+        {
+            if (command == PROFILE_GS_L)
+            {
+                gsXlPrintBeginGsl(rows * s, bytes);
+            }
+            else
+            {
+                gsXlPrintBeginGsv0(rows * s, bytes);
+            }
+            for (unsigned int r = 0; r < rows * s; r++) // each line is "s" dot rows, dithered separately
+            {
+                rasterTiles(group, count, rasters, base + r / s, band);
+                epson_write(band, bytes);
+            }
+            if (command == PROFILE_GS_L)
+            {
+                finishPrint();
+            }
+        }
+
+        // like finishBand(), the rows are kept until all the tiles are printed
+        epson_flush();
+        statsRecord(&stats.band, micros() - bandStartUs - bandIdleUs);
+        if (profile.bandDelayMs)
+        {
+            vTaskDelay(pdMS_TO_TICKS(profile.bandDelayMs));
+        }
+        bandStartUs = micros();
+        bandIdleUs = 0;
+    }
+    free(rasters);
+    free(band);
+
+    epson_feed(2);
+    epson_flush();
+    unsigned long time = micros() - start;
+    statsRecord(&stats.job, time);
+    stats.jobs++;
+    stats.lastJobBytes = epsonTxBytes - sent;
+    stats.lastJobBytesPerSecond = (uint64_t)stats.lastJobBytes * 1000000 / (time ? time : 1);
+    Log.println("Print finished");
+    digitalWrite(PIN_LED, HIGH);
+
+#if SEND_TO_PC_AFTER_PRINTING
+    for (byte i = 0; i < count; i++)
+    {
+        sendBufferToPc(group[i]);
+    }
+#endif
+}
+
+/**
+ * Rasterizes the next dot row of every tile side by side, from image row "row"
+ * Tiles shorter than that are left white
+ */
+void rasterTiles(print_job_t **group, byte count, raster_t *rasters, unsigned int row, byte *dst)
+{
+    unsigned int bytes = EPSON_BYTES_PER_LINE * rasters[0].xScale;
+    for (byte i = 0; i < count; i++)
+    {
+        if (row < group[i]->rows)
+        {
+            rasterRow(&rasters[i], jobRow(group[i], row), dst);
+        }
+        else
+        {
+            memset(dst, 0, bytes);
+        }
+        dst += bytes;
+    }
+}
+
+/**
+ * Sends the staged band, then gives the printed rows back if the pool runs low
+ */
+void finishBand(print_job_t *job, unsigned int row)
+{
+    epson_flush();
+    statsRecord(&stats.band, micros() - bandStartUs - bandIdleUs);
+    if (profile.bandDelayMs)
+    {
+        vTaskDelay(pdMS_TO_TICKS(profile.bandDelayMs));
+    }
+    recycleRows(job, row);
+    bandStartUs = micros();
+    bandIdleUs = 0;
+}
+
+/**
+ * Counts the blank "ESC *" columns (of "size" bytes) on both sides of a band
+ * Returns how many can be cut from each side so the centered image stays in place, "count" if the band is blank
+ */
+unsigned int blankColumns(const byte *columns, unsigned int count, byte size)
+{
+    if (profile.flags & PROFILE_NO_SKIP)
+    {
+        return 0;
+    }
+
+    unsigned int left = 0;
+    while (left < count && isBlank(columns + left * size, size))
+    {
+        left++;
+    }
+    if (left == count)
+    {
+        return count;
+    }
+    unsigned int right = 0;
+    while (right < left && isBlank(columns + (count - 1 - right) * size, size))
+    {
+        right++;
+    }
+    return right;
+}
+
+/**
+ * Finds the blank rows at the *top and *bottom of "count" rows of the job, with the rasterizer's settings
+ * Returns how many blank pixels can be cut from both sides of the rest, *top is "count" if all are blank
+ */
+unsigned int trimRows(print_job_t *job, unsigned int firstRow, unsigned int count, unsigned int *top, unsigned int *bottom)
+{
+    *top = 0;
+    *bottom = 0;
+    if (profile.flags & PROFILE_NO_SKIP)
+    {
+        return 0;
+    }
+
+    unsigned int cut = RASTER_PIXELS / 2;
+    bool ink = false;
+    for (unsigned int r = 0; r < count; r++)
+    {
+        unsigned int left, right;
+        rasterMargins(&raster, jobRow(job, firstRow + r), &left, &right);
+        if (left == RASTER_PIXELS)
+        { // blank
+            if (ink)
+            {
+                (*bottom)++;
+            }
+            else
+            {
+                (*top)++;
+            }
+            continue;
+        }
+        ink = true;
+        *bottom = 0;
+        cut = min(cut, min(left, right));
+    }
+    return ink ? cut : 0;
+}
+
+/**
+ * True if all bytes are 0
+ */
+bool isBlank(const byte *data, unsigned int length)
 {
-    epson_write(29); // GS
-    epson_write(40); // (
-    epson_write(76); // L
-    epson_write(2);  // pL
-    epson_write(0);  // pH
-    epson_write(48); // m
-    epson_write(50); // fn
+    for (unsigned int i = 0; i < length; i++)
+    {
+        if (data[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// By scale, then by bytes sent per image row
+const print_encoder_t printEncoders[] = {
+    {"GS ( L", PROFILE_GS_L, 1, EPSON_BYTES_PER_LINE, printGsl},
+    {"GS v 0", PROFILE_GS_V0, 1, EPSON_BYTES_PER_LINE, printGsv0},
+    {"GS ( L", PROFILE_GS_L, 2, EPSON_BYTES_PER_LINE, printGsl}, // scaled by the printer
+    {"GS v 0", PROFILE_GS_V0, 2, EPSON_BYTES_PER_LINE, printGsv0},
+    {"ESC *", PROFILE_ESC_ASTERISK, 2, EPSON_BYTES_PER_LINE * 2, printEscAsterisk<1, 2, 24, 32>},
+    {"GS ( L XL", PROFILE_GS_L, 2, EPSON_BYTES_PER_LINE * 4, gsXlPrint<2, PROFILE_GS_L>},
+    {"GS v 0 XL", PROFILE_GS_V0, 2, EPSON_BYTES_PER_LINE * 4, gsXlPrint<2, PROFILE_GS_V0>},
+    {"ESC *", PROFILE_ESC_ASTERISK, 3, EPSON_BYTES_PER_LINE * 3, printEscAsterisk<3, 1, 8, 1>}, // 8-dot rows scaled by the printer
+    {"GS ( L XL", PROFILE_GS_L, 3, EPSON_BYTES_PER_LINE * 9, gsXlPrint<3, PROFILE_GS_L>},
+    {"GS v 0 XL", PROFILE_GS_V0, 3, EPSON_BYTES_PER_LINE * 9, gsXlPrint<3, PROFILE_GS_V0>},
+    {"GS ( L XL", PROFILE_GS_L, 4, EPSON_BYTES_PER_LINE * 16, gsXlPrint<4, PROFILE_GS_L>},
+    {"GS v 0 XL", PROFILE_GS_V0, 4, EPSON_BYTES_PER_LINE * 16, gsXlPrint<4, PROFILE_GS_V0>}};
+
+#define PRINT_ENCODER_COUNT (sizeof(printEncoders) / sizeof(printEncoders[0]))
+
+/**
+ * Picks the fastest encoder "profile" allows at "scale", or at the largest scale below it that fits the head
+ * Scale 0 starts from RASTER_MAX_SCALE, so the image fills as much of the head as it can
+ * Multiple tone printers get GS ( L scaled by the printer, so at most 2x, to keep the grays
+ * Falls back to ESC * 2x, which every printer takes
+ */
+const print_encoder_t *chooseEncoder(const printer_profile_t *profile)
+{
+    byte allowed = profile->command ? profile->command : profile->commands;
+    byte top = scale ? scale : RASTER_MAX_SCALE;
+    if ((profile->flags & PROFILE_MULTI_TONE) && (allowed & PROFILE_GS_L))
+    {
+        allowed = PROFILE_GS_L;
+        top = min(top, (byte)2);
+    }
+    for (byte s = top; s > 0; s--)
+    {
+        if (IMG_WIDTH * s > profile->headDots)
+        {
+            continue;
+        }
+        for (byte i = 0; i < PRINT_ENCODER_COUNT; i++)
+        {
+            if (printEncoders[i].scale == s && (printEncoders[i].command & allowed))
+            {
+                return &printEncoders[i];
+            }
+        }
+    }
+    return &printEncoders[4];
+}
+
+/**
+ * Tells if the job can still be printed, from its rows or from the cache
+ */
+bool printable(print_job_t *job)
+{
+    return job->firstRow == 0 || (job->complete && cacheFind(cacheKey(job, chooseEncoder(&profile), &profile)) != NULL);
+}
+
+/**
+ * Largest scale at which "count" images fit side by side on the head, up to "scale", 0 if they don't fit at 1x
+ */
+byte tileScale(byte count)
+{
+    for (byte s = scale ? scale : RASTER_MAX_SCALE; s > 0; s--)
+    {
+        if (count * IMG_WIDTH * s <= profile.headDots)
+        {
+            return s;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Holds the job, and the ones queued after it, until "tiles" images to print side by side are there
+ * Only complete images up to a frame high are held, the pool must keep room for the next one
+ * Images sent to another printer end the group, it is printed on the first one's printer
+ * Returns the number of images in the group, 1 to print the job alone
+ */
+byte gatherTiles(print_job_t **group)
+{
+    byte count = min((unsigned int)min(tiles, (byte)PRINT_TILES_MAX), stripPoolSize / (IMG_HEIGHT / STRIP_ROWS));
+    while (count > 1 && tileScale(count) == 0)
+    {
+        count--;
+    }
+    if (count < 2 || !tileable(group[0]))
+    {
+        return 1;
+    }
+
+    byte n = 1;
+    group[0]->state = JOB_HELD; // the Game Boy may send the next one
+    print_job_t *next;
+    while (n < count && xQueuePeek(printQueue, &next, pdMS_TO_TICKS(TILE_WAIT_MS)) == pdTRUE)
+    {
+        if (next->printer != group[0]->printer || !tileable(next))
+        { // printed alone, after this group, or on another printer
+            break;
+        }
+        xQueueReceive(printQueue, &next, 0);
+        next->state = JOB_HELD;
+        group[n++] = next;
+    }
+    for (byte i = 0; i < n; i++)
+    {
+        group[i]->state = JOB_QUEUED;
+    }
+    return n;
+}
+
+/**
+ * Waits for the job to be complete, tells if it can be printed beside others
+ * Taller images are not waited for, they are streamed as usual
+ */
+bool tileable(print_job_t *job)
+{
+    while (!job->complete && job->rows <= IMG_HEIGHT)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    }
+    return !job->calibrate && job->firstRow == 0 && job->rows > 0 && job->rows <= IMG_HEIGHT;
+}
+
+/**
+ * Allocates the cache slots, in PSRAM if the board has it
+ */
+void cacheSetup()
+{
+    byte *memory = NULL;
+    if (psramFound())
+    {
+        cacheSlotCount = PSRAM_CACHE_SLOTS;
+        cacheSlotSize = PSRAM_CACHE_SLOT_SIZE;
+        memory = (byte *)ps_malloc(cacheSlotCount * cacheSlotSize);
+    }
+    if (memory == NULL)
+    {
+        cacheSlotCount = CACHE_SLOTS;
+        cacheSlotSize = CACHE_SLOT_SIZE;
+        memory = (byte *)malloc(cacheSlotCount * cacheSlotSize);
+    }
+    if (memory == NULL)
+    {
+        cacheSlotCount = 0;
+        Log.println("# ERROR: No memory for the print cache");
+        return;
+    }
+    for (unsigned int i = 0; i < cacheSlotCount; i++)
+    {
+        cacheSlots[i] = {0, 0, 0, memory + i * cacheSlotSize};
+    }
+}
+
+/**
+ * Identifies a print: the image, and everything the encoder's output depends on
+ */
+uint32_t cacheKey(print_job_t *job, const print_encoder_t *encoder, const printer_profile_t *profile)
+{
+    byte settings[] = {(byte)(encoder - printEncoders), job->palette, dither, threshold,
+                       (byte)(job->rows & 0xFF), (byte)(job->rows >> 8)};
+    uint32_t key = crc32_update(job->hash, settings, sizeof(settings));
+    key = crc32_update(key, (const byte *)profile, sizeof(*profile));
+    return key ? key : 1; // 0 marks a free slot
+}
+
+/**
+ * Returns the slot holding the print, or NULL
+ */
+cache_slot_t *cacheFind(uint32_t key)
+{
+    for (unsigned int i = 0; i < cacheSlotCount; i++)
+    {
+        if (cacheSlots[i].key == key)
+        {
+            return &cacheSlots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Sends a cached print, returns false if it isn't cached
+ * Band delays of the profile would be lost, so nothing is sent from the cache when there are some
+ */
+bool cachePrint(uint32_t key)
+{
+    cache_slot_t *slot = cacheFind(key);
+    if (slot == NULL || profile.bandDelayMs > 0)
+    {
+        return false;
+    }
+    slot->lastUsed = ++cacheClock;
+    epson_flush();
+    for (uint32_t sent = 0; sent < slot->length; sent += EPSON_FLUSH_SIZE)
+    {
+        uint32_t length = slot->length - sent;
+        epson_send(slot->data + sent, (length < EPSON_FLUSH_SIZE) ? length : EPSON_FLUSH_SIZE);
+    }
+    stats.cacheHits++;
+    return true;
+}
+
+/**
+ * Starts copying everything sent to a slot, the oldest one unless the print already has one
+ * "key" is 0 when the job is still arriving
+ */
+void cacheBegin(uint32_t key)
+{
+    if (cacheSlotCount == 0)
+    {
+        return;
+    }
+    cache_slot_t *slot = key ? cacheFind(key) : NULL;
+    for (unsigned int i = 0; i < cacheSlotCount && slot == NULL; i++)
+    {
+        if (cacheSlots[i].key == 0)
+        {
+            slot = &cacheSlots[i];
+        }
+    }
+    if (slot == NULL)
+    {
+        slot = &cacheSlots[0];
+        for (unsigned int i = 1; i < cacheSlotCount; i++)
+        {
+            if (cacheSlots[i].lastUsed < slot->lastUsed)
+            {
+                slot = &cacheSlots[i];
+            }
+        }
+    }
+
+    epson_flush(); // not part of the print
+    slot->key = 0;
+    slot->length = 0;
+    slot->lastUsed = ++cacheClock;
+    cacheFill = slot;
+}
+
+/**
+ * Copies bytes being sent to the slot being filled, it is dropped if they don't fit
+ */
+void cacheAppend(const byte *data, unsigned int length)
+{
+    if (cacheFill->length + length > cacheSlotSize)
+    {
+        cacheFill = NULL;
+        return;
+    }
+    memcpy(cacheFill->data + cacheFill->length, data, length);
+    cacheFill->length += length;
+}
+
+/**
+ * Stops copying, the slot is kept under "key", 0 drops it
+ */
+void cacheEnd(uint32_t key)
+{
+    epson_flush();
+    if (cacheFill && key)
+    {
+        cache_slot_t *old = cacheFind(key); // filled while another copy of the same print was kept
+        if (old && old != cacheFill)
+        {
+            old->key = 0;
+        }
+        cacheFill->key = key;
+    }
+    cacheFill = NULL;
+}
+
+/**
+ * Queues test_image for calibrate()
+ */
+void startCalibration()
+{
+    print_job_t *job = receiving() ? NULL : testImageJob();
+    if (job == NULL)
+    {
+        Log.println("# ERROR: Can't calibrate while receiving");
+        return;
+    }
+    job->calibrate = true;
+    queueJob(job, activePrinter);
+}
+
+/**
+ * Prints the job with each command the profile lists, at the scale print() would use,
+ * and for the banded ones with every payload in CALIBRATION_PAYLOADS
+ * Every print is timed until the printer has taken it (see waitForPrinter()), the fastest is saved to the profile
+ * A payload too large for the printer's buffer usually stalls it, but may also come out garbled, so check the prints
+ * The trials only change the print task's copy of the profile, the saved one only gets the result
+ */
+void calibrate(print_job_t *job)
+{
+    static const unsigned int payloads[] = {CALIBRATION_PAYLOADS};
+    static const byte commands[] = {PROFILE_GS_L, PROFILE_GS_V0, PROFILE_ESC_ASTERISK};
+    printer_profile_t saved = profile;
+    profile.command = 0;
+    byte printScale = chooseEncoder(&profile)->scale;
+    byte bestCommand = 0;
+    unsigned int bestPayload = saved.maxPayload;
+    unsigned long bestTime = 0;
+
+    Log.println("Calibrating");
+    for (byte c = 0; c < sizeof(commands); c++)
+    {
+        profile.command = commands[c];
+        encoder = chooseEncoder(&profile);
+        if (!(saved.commands & commands[c]) || encoder->command != commands[c] || encoder->scale != printScale)
+        {
+            continue;
+        }
+
+        byte tries = (commands[c] == PROFILE_ESC_ASTERISK) ? 1 : sizeof(payloads) / sizeof(payloads[0]); // ESC * bands don't depend on the payload
+        for (byte p = 0; p < tries; p++)
+        {
+            profile.maxPayload = (tries > 1) ? payloads[p] : saved.maxPayload;
+            epson_linespacing(profile.lineSpacing);
+            epson_center();
+            epson_print(encoder->name);
+            epson_print(" ");
+            epson_println((unsigned long)profile.maxPayload);
+            epson_flush();
+            waitForPrinter();
+
+            unsigned long start = millis();
+            unsigned long bytes = epsonTxBytes;
+            bandStartUs = micros();
+            bandIdleUs = 0;
+            encoder->print(job);
+            epson_feed(2);
+            epson_flush();
+            waitForPrinter();
+            unsigned long time = millis() - start;
+            bytes = epsonTxBytes - bytes;
+
+            Log.print("Calibration ");
+            Log.print(encoder->name);
+            Log.print(", payload: ");
+            Log.print(profile.maxPayload);
+            Log.print(", ms: ");
+            Log.print(time);
+            Log.print(", bytes/s: ");
+            Log.println(bytes * 1000 / (time ? time : 1));
+
+            if (bestCommand == 0 || time < bestTime)
+            {
+                bestCommand = commands[c];
+                bestPayload = profile.maxPayload;
+                bestTime = time;
+            }
+        }
+    }
+
+    profile = saved;
+    if (bestCommand == 0)
+    {
+        Log.println("# ERROR: No command in the profile fits the head");
+        return;
+    }
+    // merged into the saved profile, other fields may have been changed meanwhile
+    xSemaphoreTake(profileLock, portMAX_DELAY);
+    printers[activePrinter].profile.command = bestCommand;
+    printers[activePrinter].profile.maxPayload = bestPayload;
+    savePrinterProfile(activePrinter);
+    profile = printers[activePrinter].profile;
+    xSemaphoreGive(profileLock);
+    printProfile(&profile);
+
+    encoder = chooseEncoder(&profile);
+    epson_print("fastest: ");
+    epson_print(encoder->name);
+    epson_print(" ");
+    epson_println((unsigned long)bestPayload);
+    epson_feed(2);
+    epson_flush();
+}
+
+/**
+ * Adds a time to a stage's histogram
+ */
+void statsRecord(stats_timer_t *timer, unsigned long us)
+{
+    byte bin = us ? 32 - __builtin_clz(us) : 0;
+    timer->bins[(bin < STATS_BINS) ? bin : STATS_BINS - 1]++;
+    timer->count++;
+    timer->totalUs += us;
+    if (us > timer->maxUs)
+    {
+        timer->maxUs = us;
+    }
+}
+
+/**
+ * Prints a histogram as "bin:count" pairs, only bins that were hit
+ */
+void printHistogram(const uint32_t *bins, byte count)
+{
+    for (byte i = 0; i < count; i++)
+    {
+        if (bins[i])
+        {
+            Log.print(" <");
+            Log.print(1UL << i);
+            Log.print(":");
+            Log.print(bins[i]);
+        }
+    }
+    Log.println("");
+}
+
+/**
+ * Prints a stage's times in us
+ */
+void printTimer(const char *name, const stats_timer_t *timer)
+{
+    Log.print(name);
+    Log.print(" count: ");
+    Log.print(timer->count);
+    Log.print(", avg us: ");
+    Log.print(timer->count ? (unsigned long)(timer->totalUs / timer->count) : 0UL);
+    Log.print(", max us: ");
+    Log.print(timer->maxUs);
+    Log.print(", total ms: ");
+    Log.println((unsigned long)(timer->totalUs / 1000));
+    Log.print("  us");
+    printHistogram(timer->bins, STATS_BINS);
+}
+
+/**
+ * Dumps the statistics to the PC
+ */
+void printStats()
+{
+    Log.print("Boot: taking prints at ms: ");
+    Log.print(bootReadyMs);
+    Log.print(", printer connected at ms: ");
+    if (bootPrinterMs)
+    {
+        Log.println(bootPrinterMs);
+    }
+    else
+    {
+        Log.println("not yet");
+    }
+    for (byte i = 0; i < GBP_PORTS; i++)
+    {
+        const gbp_link_stats_t *link = &(gbp_printers[i].gbp_link_stats);
+        Log.print("Link ");
+        Log.print(i);
+        Log.print(" ISR calls: ");
+        Log.print(link->isr_calls);
+        Log.print(", max cycles: ");
+        Log.println(link->isr_cycles_max);
+        Log.print("  cycles");
+        printHistogram(link->isr_cycles, GBP_STATS_BINS);
+        Log.print("Link ");
+        Log.print(i);
+        Log.print(" packets: ");
+        Log.print(link->packets);
+        Log.print(", checksum errors: ");
+        Log.print(link->checksum_errors);
+        Log.print(", packet errors: ");
+        Log.print(link->packet_errors);
+        Log.print(", timeouts: ");
+        Log.print(link->timeouts);
+        Log.print(", realigns: ");
+        Log.print(link->realigns);
+        Log.print(", dropped: ");
+        Log.println(gbp_printers[i].gbp_packet_ring.dropped);
+    }
+    for (byte i = 0; i < PRINTERS; i++)
+    {
+        Log.print("Printer ");
+        Log.print(i);
+        Log.print(" images: ");
+        Log.print(printers[i].printed);
+        Log.print(", waiting: ");
+        Log.println(printers[i].queued - printers[i].printed);
+    }
+
+    printTimer("Receive", &stats.receive);
+    printTimer("Band", &stats.band);
+    printTimer("Bluetooth write", &stats.btWrite);
+    printTimer("Job", &stats.job);
+    printTimer("Wake", &stats.wake);
+
+    // the state being spent counts too
+    uint32_t powerMs[POWER_STATES];
+    memcpy(powerMs, stats.powerMs, sizeof(powerMs));
+    powerMs[powerState] += millis() - powerStateMs;
+    uint64_t mAms = (uint64_t)powerMs[POWER_ACTIVE] * POWER_ACTIVE_MA + (uint64_t)powerMs[POWER_IDLE] * POWER_IDLE_MA +
+                    (uint64_t)powerMs[POWER_SLEEP] * POWER_SLEEP_MA;
+    Log.print("Power: active s: ");
+    Log.print(powerMs[POWER_ACTIVE] / 1000);
+    Log.print(", idle s: ");
+    Log.print(powerMs[POWER_IDLE] / 1000);
+    Log.print(", light sleep s: ");
+    Log.print(powerMs[POWER_SLEEP] / 1000);
+    Log.print(", light sleeps: ");
+    Log.print(stats.lightSleeps);
+    Log.print(", about mAh: ");
+    Log.println((unsigned long)(mAms / 3600000));
+    Log.print("Jobs: ");
+    Log.print(stats.jobs);
+    Log.print(", last job bytes: ");
+    Log.print(stats.lastJobBytes);
+    Log.print(", bytes/s: ");
+    Log.println(stats.lastJobBytesPerSecond);
+    Log.print("Cached prints sent: ");
+    Log.print(stats.cacheHits);
+    Log.print(", cache slots: ");
+    Log.print(cacheSlotCount);
+    Log.print(" of ");
+    Log.print(cacheSlotSize);
+    Log.println(" bytes");
+    Log.print("Archived images: ");
+    Log.print(stats.archived);
+    Log.print(", dropped packets: ");
+    Log.println(stats.archiveDropped);
+}
+
+/**
+ * NVS key of a printer, its MAC address in hex
+ */
+void printerKey(byte printer, char *key)
+{
+    for (byte i = 0; i < 6; i++)
+    {
+        sprintf(key + 2 * i, "%02X", printers[printer].address[i]);
+    }
+}
+
+/**
+ * Copy of the active printer's saved profile, for tasks other than the print task
+ */
+printer_profile_t activeProfile()
+{
+    xSemaphoreTake(profileLock, portMAX_DELAY);
+    printer_profile_t saved = printers[activePrinter].profile;
+    xSemaphoreGive(profileLock);
+    return saved;
+}
+
+/**
+ * Loads the profile saved for the printer, or the defaults
+ */
+void loadPrinterProfile(byte printer)
+{
+    char key[13];
+    printerKey(printer, key);
+    xSemaphoreTake(profileLock, portMAX_DELAY);
+    printer_profile_t *profile = &printers[printer].profile;
+    preferences.begin("profiles", true);
+    size_t length = preferences.getBytesLength(key) == sizeof(*profile) ? preferences.getBytes(key, profile, sizeof(*profile)) : 0;
+    preferences.end();
+
+    if (length != sizeof(*profile) || profile->version != PROFILE_VERSION)
+    {
+        *profile = {0};
+        profile->version = PROFILE_VERSION;
+        profile->commands = PROFILE_COMMANDS;
+        profile->lineSpacing = PROFILE_LINE_SPACING;
+        profile->headDots = PROFILE_HEAD_DOTS;
+        profile->maxPayload = PROFILE_MAX_PAYLOAD;
+        profile->bandFeed = PROFILE_BAND_FEED;
+        profile->bandDelayMs = PROFILE_BAND_DELAY_MS;
+    }
+    printer_profile_t loaded = *profile;
+    xSemaphoreGive(profileLock);
+    printProfile(&loaded);
+}
+
+/**
+ * Saves the printer's profile, the caller holds profileLock
+ */
+void savePrinterProfile(byte printer)
+{
+    char key[13];
+    printerKey(printer, key);
+    preferences.begin("profiles", false);
+    if (preferences.putBytes(key, &printers[printer].profile, sizeof(printer_profile_t)) != sizeof(printer_profile_t))
+    {
+        Log.println("# ERROR: Profile not saved");
+    }
+    preferences.end();
+}
+
+/**
+ * Prints a profile to the PC
+ */
+void printProfile(const printer_profile_t *profile)
+{
+    Log.print("Profile head: ");
+    Log.print(profile->headDots);
+    Log.print(", commands: ");
+    Log.print(profile->commands);
+    Log.print(", command: ");
+    Log.print(profile->command);
+    Log.print(", payload: ");
+    Log.print(profile->maxPayload);
+    Log.print(", spacing: ");
+    Log.print(profile->lineSpacing);
+    Log.print(", feed: ");
+    Log.print(profile->bandFeed);
+    Log.print(", delay: ");
+    Log.print(profile->bandDelayMs);
+    Log.print(", flags: ");
+    Log.println(profile->flags);
+}
+
+/**
+ * Collects a command line from the PC and runs it
+ */
+void updateSerialCommands()
+{
+    static char line[COMMAND_LENGTH + 1];
+    static byte length = 0;
+    while (Serial.available() > 0)
+    {
+        char c = Serial.read();
+        if (c == '\r' || c == '\n')
+        {
+            if (length > 0)
+            {
+                line[length] = 0;
+                runCommand(line);
+                length = 0;
+            }
+        }
+        else if (length < COMMAND_LENGTH)
+        {
+            line[length++] = c;
+        }
+    }
 }
 
-/*
- * Provides 3x scaled print
- * since TM-T88 doesn't have big enough buffer for 3x scaled image, it must be sent in batches
+/**
+ * Runs a command from the PC
+ * calibrate                 finds the fastest command and payload, see calibrate()
+ * stats                     prints the link and print statistics, "stats reset" clears them
+ * copies <n>                prints every image n times
+ * reprint [n]               prints the last image again, n times
+ * scale <n>                 prints at n x (1-4), 0 fits the head
+ * tiles <n>                 prints n images (1-3) side by side, as many as fit the head
+ * dither <method>           none, bayer or diffusion, the last two print the palette's grays
+ * profile                   prints the printer's profile
+ * profile <field> <value>   changes and saves it, fields: head, commands, command, payload, spacing, feed, delay, flags
+ * profile reset             goes back to the defaults
  */
-void gsXlPrint()
+void runCommand(char *line)
 {
-    Serial.println("Begin xl print");
-    for (byte base = 0; base < IMG_HEIGHT; base += LINES_AT_ONCE_XL)
+    if (strcmp(line, "calibrate") == 0)
+    {
+        startCalibration();
+        return;
+    }
+    if (strcmp(line, "stats") == 0)
+    {
+        printStats();
+        return;
+    }
+    if (strcmp(line, "stats reset") == 0)
     {
-        if (baudRate == FAST_BAUD_RATE)
+        stats = {};
+        powerStateMs = millis();
+        noInterrupts();
+        for (byte i = 0; i < GBP_PORTS; i++)
         {
-            gsXlPrintBeginGsl();
+            gbp_printers[i].gbp_link_stats = {0};
+            ports[i].checksumErrors = 0;
         }
-        else
+        interrupts();
+        return;
+    }
+
+    unsigned int count = 0;
+    if (sscanf(line, "copies %u", &count) == 1 && count > 0 && count < 256)
+    {
+        copies = count;
+        return;
+    }
+    if (sscanf(line, "scale %u", &count) == 1 && count <= RASTER_MAX_SCALE)
+    {
+        scale = count;
+        return;
+    }
+    if (sscanf(line, "tiles %u", &count) == 1 && count > 0 && count <= PRINT_TILES_MAX)
+    {
+        tiles = count;
+        return;
+    }
+    static const char *dithers[] = {"dither none", "dither bayer", "dither diffusion"}; // by DITHER_*
+    for (byte i = 0; i < sizeof(dithers) / sizeof(dithers[0]); i++)
+    {
+        if (strcmp(line, dithers[i]) == 0)
         {
-            gsXlPrintBeginGsv0();
+            dither = i;
+            return;
         }
-        for (byte l = 0; l < LINES_AT_ONCE_XL; l++)
+    }
+    if (strcmp(line, "reprint") == 0 || (sscanf(line, "reprint %u", &count) == 1 && count > 0 && count < 256))
+    {
+        if (!reprint(count ? count : 1))
         {
-            byte line = base + l;
-            for (byte y = 0; y < scale; y++) // copy each line
-            {
-                for (byte x = 0; x < EPSON_BYTES_PER_LINE; x++) // for each pixel in line
-                {
-                    int i = line * EPSON_BYTES_PER_LINE + x;
-                    uint32_t out = bitscale(printBuffer[i], 3);
+            Log.println("# ERROR: Nothing to reprint");
+        }
+        return;
+    }
 
-                    byte currentBuffer[3] = {out >> 16 & 0xFF, out >> 8 & 0xFF, out & 0xFF};
-                    for (byte b = 0; b < 3; b++)
-                    {
-                        epson_write(currentBuffer[b]);
-                    }
-                    digitalWrite(PIN_LED, ((i % 60) < 10) ? HIGH : LOW);
-                }
-            }
+    if (strncmp(line, "profile", 7) != 0 || (line[7] != 0 && line[7] != ' '))
+    {
+        Log.print("# ERROR: Unknown command: ");
+        Log.println(line);
+        return;
+    }
+
+    char field[12] = "";
+    unsigned long value = 0;
+    int args = sscanf(line, "profile %11s %lu", field, &value);
+    byte printer = activePrinter; // the print task goes on with its copy, changes apply from the next job
+    if (args == 1 && strcmp(field, "reset") == 0)
+    {
+        char key[13];
+        printerKey(printer, key);
+        xSemaphoreTake(profileLock, portMAX_DELAY);
+        preferences.begin("profiles", false);
+        preferences.remove(key);
+        preferences.end();
+        xSemaphoreGive(profileLock);
+        loadPrinterProfile(printer);
+        return;
+    }
+    xSemaphoreTake(profileLock, portMAX_DELAY);
+    printer_profile_t *profile = &printers[printer].profile;
+    if (args == 2)
+    {
+        if (strcmp(field, "head") == 0)
+        {
+            profile->headDots = value;
         }
-        if (baudRate == FAST_BAUD_RATE)
+        else if (strcmp(field, "commands") == 0)
         {
-            finishPrint();
+            profile->commands = value;
+        }
+        else if (strcmp(field, "command") == 0)
+        {
+            profile->command = value;
+        }
+        else if (strcmp(field, "payload") == 0)
+        {
+            profile->maxPayload = value;
+        }
+        else if (strcmp(field, "spacing") == 0)
+        {
+            profile->lineSpacing = value;
+        }
+        else if (strcmp(field, "feed") == 0)
+        {
+            profile->bandFeed = value;
+        }
+        else if (strcmp(field, "delay") == 0)
+        {
+            profile->bandDelayMs = value;
+        }
+        else if (strcmp(field, "flags") == 0)
+        {
+            profile->flags = value;
+        }
+        else
+        {
+            xSemaphoreGive(profileLock);
+            Log.print("# ERROR: Unknown profile field: ");
+            Log.println(field);
+            return;
         }
+        savePrinterProfile(printer);
     }
+    printer_profile_t saved = *profile;
+    xSemaphoreGive(profileLock);
+    printProfile(&saved);
 }
 
-/**
- * Starts scaled print batch
+/** 
+ * Recieves the data from the Game Boy and transforms it for the printer
+ * 2-bit depth 8*8 tiles -> 2-bit depth in line pixels, the palette is applied when printing
+ * The first rows start a new image, which is queued straight away when streaming
  */
-void gsXlPrintBeginGsl()
+void recieveData(link_port_t *port, const gbp_packet_t *packet)
 {
-    unsigned int w = IMG_WIDTH * 3;
-    unsigned int h = LINES_AT_ONCE_XL * 3;
-    unsigned int payload = w / 8 * h + 10;
-    epson_write(29);                  // GS
-    epson_write(40);                  // (
-    epson_write(76);                  // L
-    epson_write(payload & 0xFF);      // pL
-    epson_write(payload >> 8 & 0xFF); // pH
-    epson_write(48);                  // m
-    epson_write(112);                 // fn
-    epson_write(48);                  // a
-    epson_write(1);                   // bx
-    epson_write(1);                   // by
-    epson_write(49);                  // c
-    epson_write(w & 0xFF);            // xL
-    epson_write(w >> 8 & 0xFF);       // xH
-    epson_write(h);                   // yL
-    epson_write(0);                   // yH
-}
+    Log.println("Recieving data...");
+    byte rows[STRIP_BYTES];
+    unsigned int count = decodeTiles(packet, rows) / ROW_BYTES;
+    if (count == 0)
+    { // empty data packet, marks the end of the image
+        return;
+    }
 
-/**
- * Starts scaled print batch
- * method for older printers
- */
-void gsXlPrintBeginGsv0()
-{
-    unsigned int w = IMG_WIDTH * 3;
-    unsigned int h = LINES_AT_ONCE_XL * 3;
-    epson_write(29);                  // GS
-    epson_write(118);                 // v
-    epson_write(48);                  // 0
-    epson_write(48);                  // m (scale)
-    epson_write((w / 8) & 0xFF);      // xL
-    epson_write((w / 8) >> 8 & 0xFF); // xH
-    epson_write(h);                   // yL
-    epson_write(0);                   // yH
-}
+    print_job_t *job = port->receiveJob;
+    if (job == NULL)
+    {
+        job = newJob();
+        if (job == NULL)
+        {
+            Log.println("# ERROR: No free print job");
+            return;
+        }
+        job->palette = port->printer->gbp_print_settings_buffer[GBP_PRINT_BYTE_INDEX_PALETTE_VALUE]; // the previous one while streaming
+        job->port = port - ports;
+        port->receiveJob = job;
+        port->dataPackets = 0;
+    }
+    port->dataPackets++;
 
-/**
- * Clears the print buffer
- */
-void clearBuffer()
-{
-    totalBytes = 0;
-    for (int i = 0; i < BUFFER_SIZE; i++)
+    if (!appendRows(job, rows, count))
+    {
+        Log.println("# ERROR: Out of strips, rows dropped");
+    }
+    port->lastDataTime = millis();
+
+    if (streamPrint && job->state == JOB_RECEIVING)
+    {
+        queueJob(job, leastBusyPrinter());
+    }
+    if (job->state == JOB_QUEUED)
     {
-        printBuffer[i] = 0;
+        xTaskNotifyGive(printTaskHandle);
     }
 }
 
-/** 
- * Recieves the data from the Game Boy and transforms it for the printer
- * 2-bit depth 8*8 tiles -> 1-bit depth in line pixels
+/**
+ * Converts the packet's 2-bit planar tiles to 2bpp rows, a whole tile row (8 pixels) at a time
+ * bitscale<2> spreads each plane's bits apart, so the two planes interleave into 8 color values
+ * Returns the number of bytes written to dst
  */
-void recieveData()
+unsigned int decodeTiles(const gbp_packet_t *packet, byte *dst)
 {
-    Serial.println("Recieving data...");
-    byte lines = gbp_printer.gbp_packet.data_length / 16 / 20; //2
-    for (int line = 0; line < lines; line++)
+    byte lines = packet->data_length / 16 / 20; //2
+    const byte *src = packet->data_ptr;
+    for (byte line = 0; line < lines; line++)
     {
         for (byte tile = 0; tile < TILES_PER_LINE; tile++)
         {
+            byte *out = dst + tile * 2;
             for (byte j = 0; j < TILE_PIXEL_HEIGHT; j++)
             {
-                for (byte i = 0; i < TILE_PIXEL_WIDTH; i++)
-                {
-                    short offset = tile * 8 + j + 8 * TILES_PER_LINE * line;
-                    byte hiBit = (byte)((gbp_printer.gbp_packet.data_ptr[offset * 2 + 1] >> (7 - i)) & 1);
-                    byte loBit = (byte)((gbp_printer.gbp_packet.data_ptr[offset * 2] >> (7 - i)) & 1);
-                    byte val = (byte)((hiBit << 1) | loBit); // 0-3
-                    int index = (tile + TILES_PER_LINE * j) + totalBytes;
-                    if (val > 1)
-                    {
-                        printBuffer[index] = printBuffer[index] | (1 << (7 - i));
-                    }
-                }
+                byte lo = *src++;
+                byte hi = *src++;
+                uint16_t colors = (bitscale<2>(hi) & 0xAAAA) | (bitscale<2>(lo) & 0x5555);
+                out[0] = colors >> 8;
+                out[1] = colors & 0xFF;
+                out += ROW_BYTES;
             }
         }
-        totalBytes += TILES_PER_LINE * 8;
+        dst += ROW_BYTES * 8;
     }
+    return lines * ROW_BYTES * 8;
 }
 
 /**
@@ -673,23 +3223,10 @@ void printerTest()
     epson_print("scale: ");
     epson_println(scale);
     epson_print("method: ");
-    if (method == ESC_PRINT_METHOD)
-    {
-        epson_println("ESC *");
-    }
-    else
-    {
-        if (baudRate == FAST_BAUD_RATE)
-        {
-            epson_println("GS ( L");
-        }
-        else
-        {
-            epson_println("GS v 0");
-        }
-    }
+    epson_println(chooseEncoder(&profile)->name);
     epson_feed(2);
     epson_cut();
+    epson_flush();
 }
 
 /**
@@ -706,8 +3243,9 @@ void epson_start()
 //   SerialBT.begin(baudRate);
 
     // reset printer
-    SerialBT.write(27); // ESC
-    SerialBT.write(64); // @
+    epson_write(27); // ESC
+    epson_write(64); // @
+    epson_flush();
 }
 
 /**
@@ -716,9 +3254,9 @@ void epson_start()
  */
 void epson_center()
 {
-    SerialBT.write(0x1B);
-    SerialBT.write(0x61);
-    SerialBT.write(1);
+    epson_write(0x1B);
+    epson_write(0x61);
+    epson_write(1);
 }
 
 /**
@@ -736,9 +3274,25 @@ void epson_linespacing(byte spacing)
  */
 void epson_feed(byte lines)
 {
-    SerialBT.write(0x1B);
-    SerialBT.write(0x64);
-    SerialBT.write(lines);
+    epson_write(0x1B);
+    epson_write(0x64);
+    epson_write(lines);
+}
+
+/**
+ * Feeds paper by a number of dots (vertical motion units), in place of blank rows
+ * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=14
+ */
+void epson_feed_dots(unsigned int dots)
+{
+    while (dots > 0)
+    {
+        byte n = (dots > 255) ? 255 : dots;
+        epson_write(0x1B); // ESC
+        epson_write(0x4A); // J
+        epson_write(n);
+        dots -= n;
+    }
 }
 
 /**
@@ -747,18 +3301,110 @@ void epson_feed(byte lines)
  */
 void epson_cut()
 {
-    SerialBT.write(0x1D);
-    SerialBT.write(0x56);
-    SerialBT.write(cutMode);
-    SerialBT.write(0xA);
+    epson_write(0x1D);
+    epson_write(0x56);
+    epson_write(cutMode);
+    epson_write(0xA);
 }
 
 /**
- * Sends a single byte
+ * Stages a single byte, sent once EPSON_FLUSH_SIZE bytes are collected
  */
 void epson_write(byte c)
 {
-    SerialBT.write(c);
+    epsonTxBuffer[epsonTxLength++] = c;
+    if (epsonTxLength >= EPSON_FLUSH_SIZE)
+    {
+        epson_flush();
+    }
+}
+
+/**
+ * Stages a block of bytes (a whole raster line usually)
+ */
+void epson_write(const byte *data, unsigned int length)
+{
+    while (length > 0)
+    {
+        unsigned int chunk = EPSON_FLUSH_SIZE - epsonTxLength;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        memcpy(epsonTxBuffer + epsonTxLength, data, chunk);
+        epsonTxLength += chunk;
+        data += chunk;
+        length -= chunk;
+        if (epsonTxLength >= EPSON_FLUSH_SIZE)
+        {
+            epson_flush();
+        }
+    }
+}
+
+/**
+ * Sends everything staged so far in one bulk write
+ */
+void epson_flush()
+{
+    if (epsonTxLength > 0)
+    {
+        if (cacheFill)
+        {
+            cacheAppend(epsonTxBuffer, epsonTxLength);
+        }
+        epson_send(epsonTxBuffer, epsonTxLength);
+        epsonTxLength = 0;
+    }
+}
+
+/**
+ * Writes straight to the printer, bypassing the staging buffer
+ * With no printer connected the bytes are dropped and printLost is set
+ */
+void epson_send(const byte *data, unsigned int length)
+{
+    unsigned long start = micros();
+    if (SerialBT.write(data, length) != length)
+    { // lost the printer, the print task sends the job again
+        printLost = true;
+    }
+    unsigned long time = micros() - start;
+    statsRecord(&stats.btWrite, time);
+    bandIdleUs += time;
+    epsonTxBytes += length;
+}
+
+/**
+ * Asks for a real-time status byte (DLE EOT n), returns -1 if the printer does not answer
+ * https://reference.epson-biz.com/modules/ref_escpos/index.php?content_id=118
+ */
+int epson_status(byte n)
+{
+    while (SerialBT.available())
+    { // stale answers
+        SerialBT.read();
+    }
+
+    epson_write(0x10);
+    epson_write(0x04);
+    epson_write(n);
+    epson_flush();
+
+    unsigned long start = millis();
+    while (millis() - start < PRINTER_STATUS_TIMEOUT_MS)
+    {
+        if (SerialBT.available())
+        {
+            int status = SerialBT.read();
+            if ((status & 0x93) == 0x12)
+            { // bits 1 and 4 are always set, 0 and 7 always clear
+                return status;
+            }
+        }
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+    return -1;
 }
 
 /**
@@ -766,7 +3412,10 @@ void epson_write(byte c)
  */
 size_t epson_println(const char *str)
 {
-    return SerialBT.println(str);
+    size_t n = epson_print(str);
+    epson_write(13); // CR
+    epson_write(10); // LF
+    return n + 2;
 }
 
 /**
@@ -774,7 +3423,10 @@ size_t epson_println(const char *str)
  */
 size_t epson_println(unsigned long num)
 {
-    return SerialBT.println(num);
+    size_t n = epson_print(num);
+    epson_write(13); // CR
+    epson_write(10); // LF
+    return n + 2;
 }
 
 /**
@@ -782,7 +3434,9 @@ size_t epson_println(unsigned long num)
  */
 size_t epson_print(const char *str)
 {
-    return SerialBT.print(str);
+    size_t n = strlen(str);
+    epson_write((const byte *)str, n);
+    return n;
 }
 
 /**
@@ -790,60 +3444,310 @@ size_t epson_print(const char *str)
  */
 size_t epson_print(unsigned long num)
 {
-    return SerialBT.print(num);
+    char str[11];
+    ultoa(num, str, 10);
+    return epson_print(str);
+}
+
+/**
+ * Sends the rows of the job still kept to the PC via Serial, as one binary frame:
+ * "GBPX", version, bits per pixel, palette, 0, width (2 bytes), height (2 bytes),
+ * payload length (4 bytes), payload, CRC-32 of everything after "GBPX"
+ * Numbers are LSB first, rows are packed with the leftmost pixel in the high bits
+ * Text lines only come between frames (see SerialLog), the magic and the CRC let the PC skip them
+ * Nothing is sent when no rows are kept
+ */
+void sendBufferToPc(print_job_t *job)
+{
+    if (job->firstRow >= job->rows)
+    { // rows given back, or a print sent from the cache
+        return;
+    }
+    unsigned int height = job->rows - job->firstRow;
+    unsigned int rowBytes = IMG_WIDTH * PC_DUMP_BPP / 8;
+    uint32_t length = height * rowBytes;
+    byte header[16] = {'G', 'B', 'P', 'X', 1, PC_DUMP_BPP, job->palette, 0,
+                       (byte)(IMG_WIDTH & 0xFF), (byte)(IMG_WIDTH >> 8),
+                       (byte)(height & 0xFF), (byte)(height >> 8),
+                       (byte)(length & 0xFF), (byte)(length >> 8), (byte)(length >> 16), (byte)(length >> 24)};
+
+    digitalWrite(PIN_LED, LOW);
+    xSemaphoreTake(serialLock, portMAX_DELAY); // text of the other tasks waits until the frame is out
+    Serial.write(header, sizeof(header));
+    uint32_t crc = crc32_update(0, header + 4, sizeof(header) - 4);
+
+#if PC_DUMP_BPP == 1
+    byte block[STRIP_ROWS * IMG_WIDTH / 8];
+    beginRaster(job, 1, RASTER_MONO);
+    rasterSkip(&raster, job->firstRow);
+#endif
+    unsigned int row = job->firstRow;
+    while (row < job->rows)
+    {
+        // whole strips at a time, rows of a strip are together
+        unsigned int count = STRIP_ROWS - row % STRIP_ROWS;
+        if (count > job->rows - row)
+        {
+            count = job->rows - row;
+        }
+#if PC_DUMP_BPP == 1
+        for (unsigned int r = 0; r < count; r++)
+        {
+            rasterRow(&raster, jobRow(job, row + r), block + r * rowBytes);
+        }
+        const byte *data = block;
+#else
+        const byte *data = jobRow(job, row);
+#endif
+        Serial.write(data, count * rowBytes);
+        crc = crc32_update(crc, data, count * rowBytes);
+        row += count;
+    }
+
+    byte footer[4] = {(byte)(crc & 0xFF), (byte)(crc >> 8), (byte)(crc >> 16), (byte)(crc >> 24)};
+    Serial.write(footer, sizeof(footer));
+    Serial.flush();
+    xSemaphoreGive(serialLock);
+    digitalWrite(PIN_LED, HIGH);
+}
+
+#if DECODER_BENCHMARK
+namespace stock
+{
+#include "test_image.h" // the stock image, testImage is the custom frame one
+}
+
+/**
+ * Previous pixel by pixel decoder, kept as a reference for benchmarkDecoder()
+ */
+unsigned int decodeTilesReference(const gbp_packet_t *packet, byte *dst)
+{
+    byte lines = packet->data_length / 16 / 20; //2
+    for (int line = 0; line < lines; line++)
+    {
+        for (byte tile = 0; tile < TILES_PER_LINE; tile++)
+        {
+            for (byte j = 0; j < TILE_PIXEL_HEIGHT; j++)
+            {
+                for (byte i = 0; i < TILE_PIXEL_WIDTH; i++)
+                {
+                    short offset = tile * 8 + j + 8 * TILES_PER_LINE * line;
+                    byte hiBit = (byte)((packet->data_ptr[offset * 2 + 1] >> (7 - i)) & 1);
+                    byte loBit = (byte)((packet->data_ptr[offset * 2] >> (7 - i)) & 1);
+                    byte val = (byte)((hiBit << 1) | loBit); // 0-3
+                    int x = tile * TILE_PIXEL_WIDTH + i;
+                    int index = (line * 8 + j) * ROW_BYTES + x / 4;
+                    dst[index] = dst[index] | (val << (6 - 2 * (x % 4)));
+                }
+            }
+        }
+    }
+    return lines * ROW_BYTES * 8;
 }
 
 /**
- * Copies each bit in source byte to the destination uint32 "by" times
- * by = 3 in this program
- * example:
- * src: 000000000000000010010011
- * dst: 111000000111000000111111
+ * Converts the stock test image back to Game Boy tiles, decodes it with both decoders
+ * and reports the time taken and whether the results match
+ * The lo plane is filled with noise, it must not change the printed result
  */
-uint32_t bitscale(uint8_t src, uint8_t by)
+void benchmarkDecoder()
 {
-    uint32_t dst;
-    for (int8_t i = 7; i >= 0; i--)
+    static byte tiles[640];
+    static byte reference[BUFFER_SIZE * 2];
+    static byte decoded[BUFFER_SIZE * 2];
+    gbp_packet_t packet = {0};
+    packet.command = GBP_COMMAND_DATA;
+    packet.data_length = sizeof(tiles);
+    packet.data_ptr = tiles;
+
+    memset(decoded, 0, sizeof(decoded));
+    memset(reference, 0, sizeof(reference));
+    unsigned long referenceTime = 0;
+    unsigned long tableTime = 0;
+    uint32_t noise = 0x12345678;
+
+    for (unsigned int base = 0; base < BUFFER_SIZE; base += sizeof(tiles) / 2)
     {
-        for (uint8_t j = 0; j < by; j++)
+        // raster rows -> 2 tile lines of 20 tiles
+        for (byte line = 0; line < 2; line++)
         {
-            dst = dst << 1 | ((src & 1 << i) >> i);
+            for (byte tile = 0; tile < TILES_PER_LINE; tile++)
+            {
+                for (byte j = 0; j < TILE_PIXEL_HEIGHT; j++)
+                {
+                    short offset = tile * 8 + j + 8 * TILES_PER_LINE * line;
+                    noise = noise * 1103515245 + 12345;
+                    tiles[offset * 2] = noise >> 16;
+                    tiles[offset * 2 + 1] = stock::testImage[base + (line * 8 + j) * TILES_PER_LINE + tile];
+                }
+            }
         }
+
+        unsigned long start = micros();
+        decodeTilesReference(&packet, reference + base * 2);
+        referenceTime += micros() - start;
+
+        start = micros();
+        decodeTiles(&packet, decoded + base * 2);
+        tableTime += micros() - start;
+    }
+
+    Log.print("Decoder benchmark, reference us: ");
+    Log.print(referenceTime);
+    Log.print(", table us: ");
+    Log.println(tableTime);
+    Log.print("Matches reference: ");
+    Log.print(memcmp(decoded, reference, sizeof(decoded)) == 0 ? "yes" : "NO");
+
+    // colors 2 and 3 are the black dots of the test image
+    rasterBegin(&raster, 1, 0, DITHER_NONE, 2, RASTER_MONO);
+    bool matches = true;
+    for (unsigned int y = 0; y < BUFFER_SIZE / EPSON_BYTES_PER_LINE; y++)
+    {
+        byte line[EPSON_BYTES_PER_LINE];
+        rasterRow(&raster, decoded + y * ROW_BYTES, line);
+        matches = matches && memcmp(line, testImage + y * EPSON_BYTES_PER_LINE, EPSON_BYTES_PER_LINE) == 0;
+    }
+    Log.print(", matches test image: ");
+    Log.println(matches ? "yes" : "NO");
+}
+#endif
+
+#if PARSER_BENCHMARK
+/**
+ * Appends one link packet (sync word to status byte) to a recorded byte stream
+ */
+unsigned int recordPacket(byte *stream, byte command, const byte *data, unsigned int length)
+{
+    byte *out = stream;
+    unsigned int checksum = command + (length & 0xFF) + (length >> 8);
+    *out++ = GBP_SYNC_WORD_0;
+    *out++ = GBP_SYNC_WORD_1;
+    *out++ = command;
+    *out++ = GBP_COMPRESSION_DISABLED;
+    *out++ = length;
+    *out++ = length >> 8;
+    for (unsigned int i = 0; i < length; i++)
+    {
+        checksum += data[i];
+        *out++ = data[i];
     }
-    return dst;
+    *out++ = checksum;
+    *out++ = checksum >> 8;
+    *out++ = 0; // device id
+    *out++ = 0; // status
+    return out - stream;
 }
 
 /**
- * Sends the buffer contents to the PC via Serial
+ * Replays a whole test image print through the link parser and counts CPU cycles per byte
  */
-void sendBufferToPc()
+void benchmarkParser()
 {
-    for (int i = 0; i < BUFFER_SIZE; i++)
+    static byte stream[(BUFFER_SIZE / 320) * 650 + 4 * 16];
+    static byte tiles[640];
+    static gbp_printer_t printer;
+    const byte settings[4] = {1, 0x13, 0xE4, 0x40};
+    unsigned int length = 0;
+
+    length += recordPacket(stream + length, GBP_COMMAND_INIT, NULL, 0);
+    for (unsigned int base = 0; base < BUFFER_SIZE; base += sizeof(tiles) / 2)
+    {
+        for (byte line = 0; line < 2; line++)
+        {
+            for (byte tile = 0; tile < TILES_PER_LINE; tile++)
+            {
+                for (byte j = 0; j < TILE_PIXEL_HEIGHT; j++)
+                {
+                    short offset = tile * 8 + j + 8 * TILES_PER_LINE * line;
+                    tiles[offset * 2] = 0;
+                    tiles[offset * 2 + 1] = testImage[base + (line * 8 + j) * TILES_PER_LINE + tile];
+                }
+            }
+        }
+        length += recordPacket(stream + length, GBP_COMMAND_DATA, tiles, sizeof(tiles));
+    }
+    length += recordPacket(stream + length, GBP_COMMAND_DATA, NULL, 0);
+    length += recordPacket(stream + length, GBP_COMMAND_PRINT, settings, sizeof(settings));
+    length += recordPacket(stream + length, GBP_COMMAND_INQUIRY, NULL, 0);
+
+    gbp_printer_init(&printer);
+    unsigned int parsed = 0;
+    unsigned int packets = 0;
+    unsigned int checksumErrors = 0;
+    uint32_t total = 0;
+    uint32_t worst = 0;
+    bool newTx;
+    byte tx;
+
+    // sync words are found by the byte streamer, only the bytes after them reach the parser
+    for (unsigned int i = 0; i < length; i++)
     {
-        if (i % 16 == 0)
+        if (stream[i] == GBP_SYNC_WORD_0 && stream[i + 1] == GBP_SYNC_WORD_1 && printer.gbp_packet_parser.parse_state == GBP_PARSE_STATE_COMMAND)
         {
-            Serial.println("");
+            i++;
+            continue;
         }
-        digitalWrite(PIN_LED, ((i % 60) < 10) ? HIGH : LOW);
-        Serial.print("0x");
-        if (printBuffer[i] < 0x10)
+
+        uint32_t start = ESP.getCycleCount();
+        gbp_parse_message_update(&(printer.gbp_packet_parser), &(printer.gbp_packet), &printer, true, stream[i], &newTx, &tx);
+        uint32_t cycles = ESP.getCycleCount() - start;
+        parsed++;
+        total += cycles;
+        worst = max(worst, cycles);
+
+        if (printer.gbp_packet_parser.parse_state == GBP_PARSE_STATE_PACKET_RECEIVED)
         {
-            Serial.print("0");
+            packets++;
+            checksumErrors += printer.gbp_printer_status.checksum_error;
+            gbp_parse_message_reset(&(printer.gbp_packet_parser));
+            if (gbp_packet_ring_peek(&(printer.gbp_packet_ring)) != NULL)
+            { // NAKed packets never reach the ring
+                gbp_packet_ring_pop(&(printer.gbp_packet_ring));
+            }
         }
-        Serial.print(printBuffer[i], HEX);
-        Serial.print(", ");
     }
+
+    Log.print("Parser benchmark, bytes: ");
+    Log.print(length);
+    Log.print(", packets: ");
+    Log.print(packets);
+    Log.print(", checksum errors: ");
+    Log.println(checksumErrors);
+    Log.print("Cycles per byte, average: ");
+    Log.print(total / parsed);
+    Log.print(", worst: ");
+    Log.println(worst);
 }
+#endif
 
 /**
- * Copies test_image to buffer at the start
+ * Takes a new job and fills it with test_image
  */
-void copyTestImageToBuffer()
+print_job_t *testImageJob()
 {
-    for (int i = 0; i < BUFFER_SIZE; i++)
+    print_job_t *job = newJob();
+    if (job == NULL)
     {
-        printBuffer[i] = testImage[i];
+        return NULL;
+    }
+    for (unsigned int i = 0; i < BUFFER_SIZE; i += EPSON_BYTES_PER_LINE)
+    { // black dots are color 3
+        byte row[ROW_BYTES];
+        bitscale_line<2>(testImage + i, EPSON_BYTES_PER_LINE, row);
+        appendRows(job, row, 1);
     }
-    totalBytes = BUFFER_SIZE;
-    Serial.println("Test image copied to buffer");
+    job->complete = true;
+    return job;
+}
+
+/**
+ * Copies test_image to a job at the start, the button prints it
+ */
+void copyTestImageToBuffer()
+{
+    print_job_t *job = testImageJob();
+    job->state = JOB_PRINTED;
+    lastJob = job;
+    Log.println("Test image copied to buffer");
 }
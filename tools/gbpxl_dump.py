@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Receiver for the binary frames sent with SEND_TO_PC_AFTER_PRINTING
+
+Reads the ESP32's serial port (or a file captured from it), passes the text
+lines through to stdout and saves every good frame as NNNNN.bin (the payload
+as sent) and NNNNN.pgm (one gray level per color or dot, viewable anywhere).
+
+    python3 tools/gbpxl_dump.py /dev/ttyUSB0 prints/
+    python3 tools/gbpxl_dump.py capture.raw prints/ --file
+
+Needs pyserial for serial ports.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = b"GBPX"
+HEADER = struct.Struct("<BBBBHHI")  # version, bpp, palette, 0, width, height, length
+
+
+class Reader:
+    """Byte source, either a serial port or a file"""
+
+    def __init__(self, path, baud, is_file):
+        if is_file:
+            self.port = open(path, "rb")
+        else:
+            import serial
+
+            self.port = serial.Serial(path, baud, timeout=1)
+        self.is_file = is_file
+
+    def read(self, n):
+        data = b""
+        while len(data) < n:
+            chunk = self.port.read(n - len(data))
+            if not chunk:
+                if self.is_file:
+                    raise EOFError
+                continue
+            data += chunk
+        return data
+
+
+def unpack(payload, width, height, bpp):
+    """Packed rows to one byte per pixel, 0 is white"""
+    per_byte = 8 // bpp
+    mask = (1 << bpp) - 1
+    row_bytes = width * bpp // 8
+    pixels = bytearray()
+    for y in range(height):
+        for b in payload[y * row_bytes:(y + 1) * row_bytes]:
+            for p in range(per_byte - 1, -1, -1):
+                pixels.append((b >> (p * bpp)) & mask)
+    return pixels
+
+
+def save(directory, number, bpp, palette, width, height, payload):
+    base = os.path.join(directory, "%05d" % number)
+    with open(base + ".bin", "wb") as f:
+        f.write(payload)
+
+    pixels = unpack(payload, width, height, bpp)
+    if bpp == 2:
+        # colors through the print palette, 0 is the default one
+        palette = palette or 0xE4
+        shades = [(palette >> (2 * c)) & 3 for c in range(4)]
+        pixels = bytes(255 - shades[c] * 85 for c in pixels)
+    else:
+        pixels = bytes(0 if d else 255 for d in pixels)
+    with open(base + ".pgm", "wb") as f:
+        f.write(b"P5\n%d %d\n255\n" % (width, height))
+        f.write(pixels)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("source", help="serial port, or file with --file")
+    parser.add_argument("directory", help="where the prints are saved")
+    parser.add_argument("--baud", type=int, default=921600, help="PC_DUMP_BAUD_RATE")
+    parser.add_argument("--file", action="store_true", help="read a capture instead of a serial port")
+    parser.add_argument("--first", type=int, default=0, help="number of the first print saved")
+    args = parser.parse_args()
+
+    os.makedirs(args.directory, exist_ok=True)
+    reader = Reader(args.source, args.baud, args.file)
+    number = args.first
+    window = b""
+    text = bytearray()
+    try:
+        while True:
+            byte = reader.read(1)
+            window = (window + byte)[-4:]
+            if window != MAGIC:
+                text += byte
+                if byte == b"\n":
+                    sys.stdout.write(text.decode("ascii", "replace"))
+                    text.clear()
+                continue
+            del text[-3:]  # start of the magic
+
+            header = reader.read(HEADER.size)
+            version, bpp, palette, _, width, height, length = HEADER.unpack(header)
+            if version != 1 or bpp not in (1, 2) or length != width * height * bpp // 8:
+                print("# ERROR: bad frame header, skipped", file=sys.stderr)
+                continue
+            payload = reader.read(length)
+            (crc,) = struct.unpack("<I", reader.read(4))
+            if zlib.crc32(header + payload) != crc:
+                print("# ERROR: CRC mismatch, print %d dropped" % number, file=sys.stderr)
+                continue
+
+            save(args.directory, number, bpp, palette, width, height, payload)
+            print("Saved %05d: %dx%d, %d bpp" % (number, width, height, bpp))
+            number += 1
+    except (EOFError, KeyboardInterrupt):
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,11 @@
+#!/bin/sh
+# Builds the replay and benchmark harness for the PC, see replay.cpp,
+# then checks the encoders against the committed golden streams
+set -e
+cd "$(dirname "$0")"
+mkdir -p build
+python3 sketch.py ../../gbpxl-BT.ino replay.cpp > build/replay_sketch.cpp
+${CXX:-g++} -std=gnu++17 -O2 -g -Wall -Wno-unused-function -Wno-unused-variable -Wno-write-strings \
+    -Ishim -I../.. -I../../gbp build/replay_sketch.cpp shim.cpp -lpthread -o build/replay
+echo "built tools/host/build/replay"
+./build/replay --golden golden --repeat 1
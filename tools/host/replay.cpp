@@ -0,0 +1,418 @@
+/**
+ * Replay and benchmark harness, runs the firmware's link, receive and encoder code on a PC
+ *
+ * Every input becomes the bytes a Game Boy would send, clocked bit by bit
+ * through the link ISR, so parsing, decompression, tile decoding and printing
+ * all run the sketch's own code. Inputs are link captures (packets in the
+ * order the Game Boy sends them, like the .bin files of the SD archive, with
+ * or without the two reply bytes after each packet) or, by default, the
+ * bundled test_image.h and test_image_custom_frame.h.
+ *
+ * For every stage it prints the time per byte. Each image is then printed with
+ * every encoder, and with --golden the output is compared to the files there:
+ * missing ones are saved, --update saves them all again. Before that the
+ * streamed print is reprinted, which has to be sent from the print cache.
+ * tools/host/golden holds the streams of the bundled images, build.sh checks
+ * them after every build.
+ *
+ *     tools/host/build.sh
+ *     tools/host/build/replay [--golden DIR] [--update] [--repeat N] [--log] [capture.bin ...]
+ *
+ * Exits with 1 if an encoder's output differs from its golden file or a reprint misses the cache.
+ */
+
+#include <string>
+#include <vector>
+
+#if GBP_LINK_SPI_SLAVE
+#error "The replay drives the bit-banged link ISR, set GBP_LINK_SPI_SLAVE to 0"
+#endif
+
+namespace plain
+{
+#include "test_image.h"
+}
+
+#define REPLAY_PRINT_WAIT_MS 10000 // longest wait for the print task to finish an image
+
+typedef struct replay_options_t
+{
+    const char *golden; // directory, NULL to skip the comparison
+    bool update;
+    unsigned int repeat; // runs of each encoder, the output is taken from the first
+} replay_options_t;
+
+/**
+ * Appends a packet as the Game Boy sends it, with the two bytes clocked for the printer's reply
+ */
+void replayPacket(std::vector<byte> *link, byte command, const byte *data, unsigned int length)
+{
+    byte header[6] = {0x88, 0x33, command, 0, (byte)(length & 0xFF), (byte)(length >> 8)};
+    uint16_t checksum = command + header[4] + header[5];
+    for (unsigned int i = 0; i < length; i++)
+    {
+        checksum += data[i];
+    }
+    link->insert(link->end(), header, header + sizeof(header));
+    link->insert(link->end(), data, data + length);
+    link->push_back(checksum & 0xFF);
+    link->push_back(checksum >> 8);
+    link->push_back(0); // device ID
+    link->push_back(0); // status
+}
+
+/**
+ * Link bytes of a 1 bit test image, black dots are color 3
+ */
+std::vector<byte> replayTestImage(const byte *image)
+{
+    std::vector<byte> link;
+    byte tiles[640];
+    replayPacket(&link, GBP_COMMAND_INIT, NULL, 0);
+    for (unsigned int base = 0; base < BUFFER_SIZE; base += sizeof(tiles) / 2)
+    {
+        for (byte line = 0; line < 2; line++)
+        {
+            for (byte tile = 0; tile < TILES_PER_LINE; tile++)
+            {
+                for (byte j = 0; j < TILE_PIXEL_HEIGHT; j++)
+                {
+                    unsigned int offset = tile * 8 + j + 8 * TILES_PER_LINE * line;
+                    byte dots = image[base + (line * 8 + j) * TILES_PER_LINE + tile];
+                    tiles[offset * 2] = dots;
+                    tiles[offset * 2 + 1] = dots;
+                }
+            }
+        }
+        replayPacket(&link, GBP_COMMAND_DATA, tiles, sizeof(tiles));
+    }
+    replayPacket(&link, GBP_COMMAND_DATA, NULL, 0);
+    static const byte settings[4] = {1, 0x13, 0xE4, 0x40}; // sheets, margins, palette, exposure
+    replayPacket(&link, GBP_COMMAND_PRINT, settings, sizeof(settings));
+    return link;
+}
+
+/**
+ * Link bytes of a capture, the reply bytes are added where they were left out
+ * Returns false if the file can't be read
+ */
+bool replayCapture(const char *path, std::vector<byte> *link)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+    std::vector<byte> raw;
+    int c;
+    while ((c = fgetc(file)) != EOF)
+    {
+        raw.push_back(c);
+    }
+    fclose(file);
+
+    size_t i = 0;
+    while (i + 8 <= raw.size())
+    {
+        if (raw[i] != 0x88 || raw[i + 1] != 0x33)
+        {
+            i++;
+            continue;
+        }
+        size_t length = raw[i + 4] | (raw[i + 5] << 8);
+        size_t end = i + 8 + length;
+        if (end > raw.size())
+        {
+            break;
+        }
+        link->insert(link->end(), raw.begin() + i, raw.begin() + end);
+        link->push_back(0);
+        link->push_back(0);
+        i = end;
+        if (i + 2 <= raw.size() && !(raw[i] == 0x88 && raw[i + 1] == 0x33))
+        { // reply bytes of the capture
+            i += 2;
+        }
+    }
+    return true;
+}
+
+/**
+ * Clocks a byte into the link ISR, most significant bit first
+ */
+void replayByte(byte b)
+{
+    for (int8_t bit = 7; bit >= 0; bit--)
+    {
+        GPIO.in = (1UL << GBP_SC_PIN) | (((b >> bit) & 1UL) << GBP_SO_PIN);
+        serialClock_ISR(&gbp_printers[0]);
+    }
+}
+
+/**
+ * Waits until the print task is done with the last image
+ */
+bool replayWaitForPrint()
+{
+    unsigned long start = millis();
+    while (uxQueueMessagesWaiting(printQueue) > 0 || (lastJob && lastJob->state == JOB_QUEUED))
+    {
+        if (millis() - start > REPLAY_PRINT_WAIT_MS)
+        {
+            return false;
+        }
+        delay(1);
+    }
+    return true;
+}
+
+/**
+ * Reprints the image the print task just printed, it was streamed and must come from the cache
+ * Returns false if it had to be encoded again
+ */
+bool replayReprint()
+{
+    if (cacheSlotCount == 0 || profile.bandDelayMs > 0)
+    { // nothing is sent from the cache
+        return true;
+    }
+    uint32_t hits = stats.cacheHits;
+    if (!reprint(1) || !replayWaitForPrint())
+    {
+        printf("  # ERROR: the image could not be reprinted\n");
+        return false;
+    }
+    if (stats.cacheHits == hits)
+    {
+        printf("  # ERROR: the reprint was not sent from the cache\n");
+        return false;
+    }
+    printf("  reprint sent from the cache\n");
+    return true;
+}
+
+/**
+ * Compares an encoder's output to its golden file, saving it if missing or updating
+ * Returns false if they differ
+ */
+bool replayGolden(const replay_options_t *options, const std::string &name, const char *data, size_t length)
+{
+    if (options->golden == NULL)
+    {
+        printf("\n");
+        return true;
+    }
+
+    std::string path = std::string(options->golden) + "/" + name + ".escpos";
+    FILE *file = options->update ? NULL : fopen(path.c_str(), "rb");
+    if (file == NULL)
+    {
+        file = fopen(path.c_str(), "wb");
+        if (file == NULL)
+        {
+            printf("   # ERROR: can't write %s\n", path.c_str());
+            return false;
+        }
+        fwrite(data, 1, length, file);
+        fclose(file);
+        printf("   saved\n");
+        return true;
+    }
+
+    std::vector<char> golden;
+    int c;
+    while ((c = fgetc(file)) != EOF)
+    {
+        golden.push_back(c);
+    }
+    fclose(file);
+
+    size_t common = (golden.size() < length) ? golden.size() : length;
+    size_t first = 0;
+    while (first < common && golden[first] == data[first])
+    {
+        first++;
+    }
+    if (first == length && length == golden.size())
+    {
+        printf("   ok\n");
+        return true;
+    }
+    printf("   DIFFERS at byte %zu (%zu bytes, golden %zu)\n", first, length, golden.size());
+    return false;
+}
+
+/**
+ * Prints the image with every encoder, timing them and checking their output
+ * Returns false if an output differs from its golden file
+ */
+bool replayEncoders(const replay_options_t *options, const std::string &image, print_job_t *job)
+{
+    // every encoder may be used
+    printer_profile_t saved = profile;
+    profile.commands = PROFILE_ESC_ASTERISK | PROFILE_GS_V0 | PROFILE_GS_L;
+    profile.headDots = RASTER_MAX_DOTS;
+
+    bool same = true;
+    for (byte i = 0; i < PRINT_ENCODER_COUNT; i++)
+    {
+        encoder = &printEncoders[i];
+        char *data = NULL;
+        size_t length = 0;
+        unsigned long time = 0;
+        for (unsigned int run = 0; run < options->repeat; run++)
+        {
+            SerialBT.capture = (run == 0) ? open_memstream(&data, &length) : NULL;
+            unsigned long start = micros();
+            encoder->print(job);
+            epson_flush();
+            time += micros() - start;
+            if (run == 0)
+            {
+                fclose(SerialBT.capture);
+                SerialBT.capture = NULL;
+            }
+        }
+        time /= options->repeat;
+
+        char name[32];
+        snprintf(name, sizeof(name), "%s %ux", encoder->name, encoder->scale);
+        printf("    %-14s %7zu bytes %8.1f ns/byte %7lu us", name, length, length ? time * 1000.0 / length : 0.0, time);
+
+        // file name: image.index-scale-command
+        std::string file = image + "." + std::to_string(i) + "-" + std::to_string(encoder->scale) + "x-";
+        for (const char *c = encoder->name; *c; c++)
+        {
+            if (*c != ' ' && *c != '(')
+            {
+                file += (*c == '*') ? 'E' : *c;
+            }
+        }
+        same = replayGolden(options, file, data, length) && same;
+        free(data);
+    }
+
+    profile = saved;
+    return same;
+}
+
+/**
+ * Replays an input, its images are printed by the print task and then by every encoder
+ * Returns false if an output differs from its golden file
+ */
+bool replayInput(const replay_options_t *options, const std::string &name, const std::vector<byte> &link)
+{
+    unsigned long linkTime = 0;
+    unsigned long loopTime = 0;
+    unsigned long payload = 0;
+    unsigned int images = 0;
+    bool same = true;
+
+    printf("%s: %zu link bytes\n", name.c_str(), link.size());
+    size_t i = 0;
+    while (i + 8 <= link.size())
+    {
+        // one packet, with its reply bytes
+        byte command = link[i + 2];
+        size_t length = link[i + 4] | (link[i + 5] << 8);
+        size_t end = i + 10 + length;
+        unsigned long start = micros();
+        for (; i < end && i < link.size(); i++)
+        {
+            replayByte(link[i]);
+        }
+        linkTime += micros() - start;
+        payload += length;
+
+        start = micros();
+        loop();
+        loopTime += micros() - start;
+
+        if (command == GBP_COMMAND_PRINT && lastJob)
+        {
+            unsigned long printed = stats.jobs;
+            if (!replayWaitForPrint())
+            {
+                printf("  # ERROR: the print task did not finish image %u\n", images);
+                return false;
+            }
+            printf("  image %u: %u rows, print task sent %u bytes at %u bytes/s%s\n", images, lastJob->rows,
+                   stats.lastJobBytes, stats.lastJobBytesPerSecond, (stats.jobs == printed) ? " (not printed)" : "");
+            if (lastJob->state == JOB_PRINTED)
+            {
+                same = replayReprint() && same;
+                same = replayEncoders(options, name + "-" + std::to_string(images), lastJob) && same;
+            }
+            images++;
+        }
+    }
+
+    printf("  link ISR  %8.1f ns/byte\n", link.size() ? linkTime * 1000.0 / link.size() : 0.0);
+    printf("  loop()    %8.1f ns/byte of payload\n", payload ? loopTime * 1000.0 / payload : 0.0);
+    printf("  errors: %u checksum, %u packet, %u dropped\n", gbp_printers[0].gbp_link_stats.checksum_errors,
+           gbp_printers[0].gbp_link_stats.packet_errors, gbp_printers[0].gbp_packet_ring.dropped);
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    replay_options_t options = {NULL, false, 20};
+    std::vector<const char *> captures;
+    bool log = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc)
+        {
+            options.golden = argv[++i];
+        }
+        else if (strcmp(argv[i], "--update") == 0)
+        {
+            options.update = true;
+        }
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            options.repeat = max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--log") == 0)
+        {
+            log = true;
+        }
+        else if (argv[i][0] == '-')
+        {
+            fprintf(stderr, "usage: %s [--golden DIR] [--update] [--repeat N] [--log] [capture.bin ...]\n", argv[0]);
+            return 2;
+        }
+        else
+        {
+            captures.push_back(argv[i]);
+        }
+    }
+
+    Serial.log = log ? stderr : NULL; // the sketch's messages
+    setup();
+    while (!btConnected)
+    { // bluetoothTask connects straight away
+        delay(1);
+    }
+
+    bool same = true;
+    if (captures.empty())
+    {
+        same = replayInput(&options, "test_image", replayTestImage(plain::testImage)) && same;
+        same = replayInput(&options, "test_image_custom_frame", replayTestImage(testImage)) && same;
+    }
+    for (const char *path : captures)
+    {
+        std::vector<byte> link;
+        if (!replayCapture(path, &link))
+        {
+            fprintf(stderr, "# ERROR: can't read %s\n", path);
+            return 2;
+        }
+        std::string name = path;
+        name = name.substr(name.find_last_of('/') + 1);
+        name = name.substr(0, name.find_last_of('.'));
+        same = replayInput(&options, name, link) && same;
+    }
+    return same ? 0 : 1;
+}
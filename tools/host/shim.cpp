@@ -0,0 +1,199 @@
+/**
+ * ESP32 Arduino core and FreeRTOS calls used by the sketch, on top of std::thread
+ * Tasks are threads, and queues are locked deques, tasks that wait just poll every millisecond
+ */
+
+#include <Arduino.h>
+#include <SD.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+HardwareSerial Serial;
+EspClass ESP;
+SDFS SD;
+gpio_shim_t GPIO;
+
+static const auto bootTime = std::chrono::steady_clock::now();
+
+unsigned long micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+int64_t esp_timer_get_time()
+{
+    return micros();
+}
+
+void delay(unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+uint32_t EspClass::getCycleCount()
+{
+    return micros() * 240;
+}
+
+int digitalRead(uint8_t) { return HIGH; } // buttons have pull-ups, nothing is pressed
+void digitalWrite(uint8_t, uint8_t) {}
+void pinMode(uint8_t, uint8_t) {}
+int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterrupt(int, void (*)(void), int) {} // the replay calls the ISR itself
+void attachInterruptArg(int, void (*)(void *), void *, int) {}
+void detachInterrupt(int) {}
+
+char *ultoa(unsigned long value, char *str, int base)
+{
+    sprintf(str, base == 16 ? "%lX" : "%lu", value);
+    return str;
+}
+
+bool psramFound() { return true; } // large strip pool, long captures stay in memory
+void *ps_malloc(size_t size) { return malloc(size); }
+
+uint32_t xPortGetCoreID() { return 1; }
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *, uint32_t, void *parameter, UBaseType_t, TaskHandle_t *handle, BaseType_t)
+{
+    std::thread *thread = new std::thread(task, parameter);
+    thread->detach();
+    if (handle)
+    {
+        *handle = thread;
+    }
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) { delay(ticks); }
+TickType_t xTaskGetTickCount() { return millis(); }
+
+uint32_t ulTaskNotifyTake(BaseType_t, TickType_t ticks)
+{
+    delay(ticks < 1 ? ticks : 1);
+    return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+
+struct queue_t
+{
+    std::mutex lock;
+    size_t itemSize;
+    size_t length;
+    std::deque<std::vector<uint8_t>> items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+    queue_t *queue = new queue_t;
+    queue->itemSize = itemSize;
+    queue->length = length;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t)
+{
+    queue_t *queue = (queue_t *)handle;
+    std::lock_guard<std::mutex> guard(queue->lock);
+    if (queue->items.size() >= queue->length)
+    {
+        return pdFALSE;
+    }
+    queue->items.emplace_back((const uint8_t *)item, (const uint8_t *)item + queue->itemSize);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t ticks)
+{
+    queue_t *queue = (queue_t *)handle;
+    for (TickType_t waited = 0;; waited++)
+    {
+        {
+            std::lock_guard<std::mutex> guard(queue->lock);
+            if (!queue->items.empty())
+            {
+                memcpy(item, queue->items.front().data(), queue->itemSize);
+                queue->items.pop_front();
+                return pdTRUE;
+            }
+        }
+        if (waited >= ticks)
+        {
+            return pdFALSE;
+        }
+        delay(1);
+    }
+}
+
+BaseType_t xQueuePeek(QueueHandle_t handle, void *item, TickType_t ticks)
+{
+    queue_t *queue = (queue_t *)handle;
+    for (TickType_t waited = 0;; waited++)
+    {
+        {
+            std::lock_guard<std::mutex> guard(queue->lock);
+            if (!queue->items.empty())
+            {
+                memcpy(item, queue->items.front().data(), queue->itemSize);
+                return pdTRUE;
+            }
+        }
+        if (waited >= ticks)
+        {
+            return pdFALSE;
+        }
+        delay(1);
+    }
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle)
+{
+    queue_t *queue = (queue_t *)handle;
+    std::lock_guard<std::mutex> guard(queue->lock);
+    return queue->items.size();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new std::timed_mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks)
+{
+    std::timed_mutex *mutex = (std::timed_mutex *)handle;
+    if (ticks == portMAX_DELAY)
+    {
+        mutex->lock();
+        return pdTRUE;
+    }
+    return mutex->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle)
+{
+    ((std::timed_mutex *)handle)->unlock();
+    return pdTRUE;
+}
+
+// No SD card, so the archive never creates its stream buffer
+StreamBufferHandle_t xStreamBufferCreate(size_t, size_t) { return NULL; }
+size_t xStreamBufferSend(StreamBufferHandle_t, const void *, size_t, TickType_t) { return 0; }
+size_t xStreamBufferReceive(StreamBufferHandle_t, void *, size_t, TickType_t) { return 0; }
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t) { return 0; }
@@ -0,0 +1,145 @@
+/**
+ * Just enough of the ESP32 Arduino core to build the sketch on a PC, see tools/host/shim.cpp
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 3
+#define RISING 4
+#define FALLING 5
+#define HEX 16
+#define DEC 10
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define SERIAL_8N1 0
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalPinToInterrupt(int pin);
+void attachInterrupt(int pin, void (*isr)(void), int mode);
+void attachInterruptArg(int pin, void (*isr)(void *), void *arg, int mode);
+void detachInterrupt(int pin);
+inline void noInterrupts() {}
+inline void interrupts() {}
+inline void pinMatrixInAttach(uint8_t, uint8_t, bool) {}
+inline void pinMatrixOutAttach(uint8_t, uint8_t, bool, bool) {}
+inline bool setCpuFrequencyMhz(uint32_t) { return true; }
+char *ultoa(unsigned long value, char *str, int base);
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) { return write(&c, 1); }
+    virtual size_t write(const uint8_t *data, size_t length) { return length; }
+    size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+    virtual void flush() {}
+
+    size_t print(const char *s) { return text("%s", s); }
+    size_t print(char c) { return text("%c", c); }
+    size_t print(int v, int base = DEC) { return text(base == HEX ? "%X" : "%d", v); }
+    size_t print(unsigned int v, int base = DEC) { return text(base == HEX ? "%X" : "%u", v); }
+    size_t print(long v, int base = DEC) { return text(base == HEX ? "%lX" : "%ld", v); }
+    size_t print(unsigned long v, int base = DEC) { return text(base == HEX ? "%lX" : "%lu", v); }
+    size_t print(double v, int digits = 2) { return text("%.*f", digits, v); }
+    template <class T> size_t println(T v) { return print(v) + print("\n"); }
+    template <class T> size_t println(T v, int base) { return print(v, base) + print("\n"); }
+    size_t println() { return print("\n"); }
+
+private:
+    template <class... T> size_t text(const char *format, T... v)
+    { // through write(), like the Arduino core
+        char buffer[64];
+        int length = snprintf(buffer, sizeof(buffer), format, v...);
+        if (length >= (int)sizeof(buffer))
+        {
+            std::vector<char> large(length + 1);
+            snprintf(large.data(), large.size(), format, v...);
+            return write((const uint8_t *)large.data(), length);
+        }
+        return write((const uint8_t *)buffer, length);
+    }
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    size_t readBytes(uint8_t *, size_t) { return 0; }
+    void setTimeout(unsigned long) {}
+};
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long, uint32_t = 0, int8_t = -1, int8_t = -1) {}
+    operator bool() { return true; }
+    using Print::write;
+    size_t write(const uint8_t *data, size_t length) override
+    { // text and binary output, like SEND_TO_PC_AFTER_PRINTING frames
+        return log ? fwrite(data, 1, length, log) : length;
+    }
+
+    FILE *log = NULL; // everything written goes here, dropped if NULL
+};
+
+extern HardwareSerial Serial;
+
+class EspClass
+{
+public:
+    uint32_t getCycleCount();
+};
+
+extern EspClass ESP;
+
+bool psramFound();
+void *ps_malloc(size_t size);
+
+// GPIO registers, the link ISR reads the pins from "in"
+struct gpio_shim_reg
+{
+    uint32_t *out;
+    bool set;
+    void operator=(uint32_t v) { *out = set ? (*out | v) : (*out & ~v); }
+};
+struct gpio_shim_t
+{
+    volatile uint32_t in;
+    uint32_t out;
+    gpio_shim_reg out_w1ts{&out, true};
+    gpio_shim_reg out_w1tc{&out, false};
+};
+extern gpio_shim_t GPIO;
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
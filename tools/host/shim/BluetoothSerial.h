@@ -0,0 +1,45 @@
+/**
+ * SPP shim, every byte sent to the printer goes to "capture"
+ */
+
+#pragma once
+#include "Arduino.h"
+
+typedef enum
+{
+    ESP_SPP_INIT_EVT,
+    ESP_SPP_DISCOVERY_COMP_EVT,
+    ESP_SPP_OPEN_EVT,
+    ESP_SPP_CLOSE_EVT
+} esp_spp_cb_event_t;
+#define ESP_SPP_SUCCESS 0
+typedef union
+{
+    struct
+    {
+        int status;
+        uint8_t scn_num;
+        uint8_t scn[4];
+    } disc_comp;
+} esp_spp_cb_param_t;
+typedef void (*esp_spp_cb_t)(esp_spp_cb_event_t event, esp_spp_cb_param_t *param);
+
+class BluetoothSerial : public Stream
+{
+public:
+    bool begin(const char *, bool = false) { return true; }
+    void end() {}
+    int register_callback(esp_spp_cb_t) { return 0; }
+    bool setPin(const char *) { return true; }
+    bool connect(uint8_t[6], int = 0) { return true; }
+    bool connect() { return true; }
+    bool connected(int = 0) { return true; }
+    bool disconnect() { return true; }
+    using Print::write;
+    size_t write(const uint8_t *data, size_t length) override
+    {
+        return capture ? fwrite(data, 1, length, capture) : length;
+    }
+
+    FILE *capture = NULL;
+};
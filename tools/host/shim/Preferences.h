@@ -0,0 +1,22 @@
+/**
+ * NVS shim, nothing is saved: every printer gets the default profile
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+class Preferences
+{
+public:
+    bool begin(const char *, bool = false) { return true; }
+    void end() {}
+    bool remove(const char *) { return true; }
+    size_t getBytesLength(const char *) { return 0; }
+    size_t getBytes(const char *, void *, size_t) { return 0; }
+    size_t putBytes(const char *, const void *, size_t length) { return length; }
+    uint32_t getUInt(const char *, uint32_t value = 0) { return value; }
+    size_t putUInt(const char *, uint32_t) { return 4; }
+    uint8_t getUChar(const char *, uint8_t value = 0) { return value; }
+    size_t putUChar(const char *, uint8_t) { return 1; }
+};
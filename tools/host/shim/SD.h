@@ -0,0 +1,31 @@
+/**
+ * SD shim, there is never a card
+ */
+
+#pragma once
+#include "Arduino.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+
+class SPIClass;
+
+class File : public Stream
+{
+public:
+    operator bool() { return false; }
+    using Print::write;
+    size_t write(const uint8_t *, size_t) override { return 0; }
+    bool seek(uint32_t) { return false; }
+    void close() {}
+};
+
+class SDFS
+{
+public:
+    bool begin(uint8_t, SPIClass &, uint32_t = 4000000) { return false; }
+    bool mkdir(const char *) { return false; }
+    File open(const char *, const char * = FILE_READ) { return File(); }
+};
+
+extern SDFS SD;
@@ -0,0 +1,11 @@
+#pragma once
+
+#define HSPI 2
+#define VSPI 3
+
+class SPIClass
+{
+public:
+    SPIClass(int) {}
+    void begin(int = -1, int = -1, int = -1, int = -1) {}
+};
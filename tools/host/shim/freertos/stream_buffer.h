@@ -0,0 +1,9 @@
+#pragma once
+#include <stddef.h>
+
+typedef void *StreamBufferHandle_t;
+
+StreamBufferHandle_t xStreamBufferCreate(size_t size, size_t trigger);
+size_t xStreamBufferSend(StreamBufferHandle_t buffer, const void *data, size_t length, TickType_t ticks);
+size_t xStreamBufferReceive(StreamBufferHandle_t buffer, void *data, size_t length, TickType_t ticks);
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t buffer);
@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+"""
+Turns gbpxl-BT.ino into C++ the way the Arduino IDE does: adds prototypes of
+its functions before the first one, so they can be called before they are
+defined. Then appends the harness, which sees everything in the sketch,
+static functions of gbp/gameboy_printer.cpp included.
+
+    python3 sketch.py ../../gbpxl-BT.ino replay.cpp > build/replay_sketch.cpp
+"""
+
+import re
+import sys
+
+FUNCTION = re.compile(r"^[A-Za-z_][\w\s\*&:<>,]*\s[\*&]?[A-Za-z_]\w*\s*\([^;]*\)\s*$")
+NOT_FUNCTIONS = ("if", "else", "for", "while", "switch", "return", "static ", "template", "#")
+
+
+def main():
+    sketch, harness = sys.argv[1], sys.argv[2]
+    lines = open(sketch).read().split("\n")
+
+    prototypes = []
+    for i, line in enumerate(lines[:-1]):
+        if FUNCTION.match(line) and lines[i + 1].strip() == "{" and not line.startswith(NOT_FUNCTIONS) \
+                and not lines[i - 1].startswith("template"):  # templates come before their first use
+            prototypes.append((i, line.strip() + ";"))
+    if not prototypes:
+        sys.exit("no functions in " + sketch)
+
+    # before the first function and its doc comment
+    first = prototypes[0][0]
+    while lines[first - 1].strip().startswith(("/**", "*", "*/")):
+        first -= 1
+
+    out = ["#include <Arduino.h>"]
+    out += ['#line 1 "%s"' % sketch]
+    out += lines[:first]
+    out += [p for _, p in prototypes]
+    out += ['#line %d "%s"' % (first + 1, sketch)]
+    out += lines[first:]
+    out += ['#line 1 "%s"' % harness]
+    out += [open(harness).read()]
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()